@@ -0,0 +1,211 @@
+/*
+ * memalloc-bench: time ALLOCATE and FREE on /dev/memalloc and count data
+ * TLB misses while touching the allocation, one CSV row per run.
+ *
+ *   memalloc-bench -n pages [-o offset_pages] [-r rounds] [-t passes] [options]
+ *
+ * Each round reserves a 2 MiB-aligned hole in the address space, places
+ * the allocation offset pages into it, allocates it, reads one word from
+ * every page passes times in a scattered order and frees it again. Run it
+ * once with memalloc loaded with huge=0 and once with huge=1 to compare
+ * 4 KiB mappings with 2 MiB ones; a nonzero offset leaves an unaligned
+ * head and tail that are always mapped with 4 KiB pages.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common.h"
+
+#define PAGE_SZ     4096UL
+#define HUGE_SZ     (2UL << 20)
+
+struct bench_opts {
+    const char      *dev;
+    const char      *label;
+    unsigned long   pages;
+    unsigned long   offset;     /* in pages from a 2 MiB boundary */
+    unsigned int    rounds;
+    unsigned int    passes;
+    int             write;
+    int             header;
+};
+
+static struct bench_opts opts = {
+    .dev    = "/dev/memalloc",
+    .label  = "default",
+    .rounds = 10,
+    .passes = 16,
+    .write  = 1,
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Data TLB load misses of this thread, -1 when the PMU doesn't provide them */
+static int open_dtlb_counter(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* An address with room for the allocation that nothing is mapped at */
+static unsigned long find_hole(unsigned long size) {
+    unsigned long span = size + 2 * HUGE_SZ;
+    void *p = mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    unsigned long addr;
+
+    if (p == MAP_FAILED)
+        return 0;
+    munmap(p, span);
+    addr = ((unsigned long)p + HUGE_SZ - 1) & ~(HUGE_SZ - 1);
+    return addr;
+}
+
+/* One read per page, striding by a prime so consecutive reads hit different pages */
+static uint64_t touch(volatile const char *base, unsigned long pages, unsigned int passes) {
+    unsigned long stride = pages % 1021 ? 1021 % pages : 1, i, page = 0;
+    uint64_t sum = 0;
+    unsigned int p;
+
+    for (p = 0; p < passes; p++) {
+        for (i = 0; i < pages; i++) {
+            sum += base[page * PAGE_SZ + (i & 63) * 8];
+            page = (page + stride) % pages;
+        }
+    }
+    return sum;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s -n pages [options]\n"
+            "  -d dev       device node (default /dev/memalloc)\n"
+            "  -o pages     start this many pages past a 2 MiB boundary (default 0)\n"
+            "  -r rounds    allocate/touch/free cycles, averaged (default 10)\n"
+            "  -t passes    reads of every page per round (default 16)\n"
+            "  -R           allocate read-only\n"
+            "  -L label     value of the label column, e.g. the module parameters\n"
+            "  -H           print the CSV header first\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    uint64_t alloc_ns = 0, free_ns = 0, touch_ns = 0, misses = 0, sum = 0, t;
+    struct alloc_info alloc_req;
+    struct free_info free_req;
+    unsigned long addr, accesses;
+    long long count;
+    unsigned int r;
+    int fd, perf, c;
+
+    while ((c = getopt(argc, argv, "d:n:o:r:t:RL:H")) != -1) {
+        switch (c) {
+        case 'd': opts.dev = optarg; break;
+        case 'n': opts.pages = strtoul(optarg, NULL, 0); break;
+        case 'o': opts.offset = strtoul(optarg, NULL, 0); break;
+        case 'r': opts.rounds = strtoul(optarg, NULL, 0); break;
+        case 't': opts.passes = strtoul(optarg, NULL, 0); break;
+        case 'R': opts.write = 0; break;
+        case 'L': opts.label = optarg; break;
+        case 'H': opts.header = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!opts.pages || !opts.rounds)
+        usage(argv[0]);
+
+    fd = open(opts.dev, O_RDWR);
+    if (fd < 0) {
+        perror(opts.dev);
+        return 1;
+    }
+    perf = open_dtlb_counter();
+
+    for (r = 0; r < opts.rounds; r++) {
+        addr = find_hole((opts.offset + opts.pages) * PAGE_SZ);
+        if (!addr) {
+            perror("mmap");
+            return 1;
+        }
+        addr += opts.offset * PAGE_SZ;
+
+        memset(&alloc_req, 0, sizeof(alloc_req));
+        alloc_req.vaddr = addr;
+        alloc_req.num_pages = opts.pages;
+        alloc_req.write = opts.write;
+        t = now_ns();
+        if (ioctl(fd, ALLOCATE, &alloc_req)) {
+            fprintf(stderr, "ALLOCATE of %lu pages at %lx failed\n", opts.pages, addr);
+            return 1;
+        }
+        alloc_ns += now_ns() - t;
+
+        if (perf >= 0) {
+            ioctl(perf, PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        t = now_ns();
+        sum += touch((const char *)addr, opts.pages, opts.passes);
+        touch_ns += now_ns() - t;
+        if (perf >= 0) {
+            ioctl(perf, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(perf, &count, sizeof(count)) == sizeof(count))
+                misses += count;
+        }
+
+        memset(&free_req, 0, sizeof(free_req));
+        free_req.vaddr = addr;
+        t = now_ns();
+        if (ioctl(fd, FREE, &free_req)) {
+            fprintf(stderr, "FREE at %lx failed\n", addr);
+            return 1;
+        }
+        free_ns += now_ns() - t;
+    }
+
+    /* Freshly zeroed pages must read back as zero */
+    if (sum)
+        fprintf(stderr, "warning: allocation was not zeroed\n");
+
+    accesses = opts.pages * opts.passes * opts.rounds;
+    if (opts.header)
+        printf("label,pages,offset,rounds,passes,alloc_us,free_us,touch_ns_per_access,"
+               "dtlb_misses_per_access\n");
+    printf("%s,%lu,%lu,%u,%u,%.1f,%.1f,%.2f,",
+           opts.label, opts.pages, opts.offset, opts.rounds, opts.passes,
+           alloc_ns / 1e3 / opts.rounds, free_ns / 1e3 / opts.rounds,
+           accesses ? (double)touch_ns / accesses : 0.0);
+    if (perf >= 0 && accesses)
+        printf("%.4f\n", (double)misses / accesses);
+    else
+        printf("NA\n");
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# Load memalloc with huge=0 and then huge=1 and run memalloc-bench over a
+# set of allocation sizes and start offsets, so each pair of rows compares
+# 4 KiB mappings against 2 MiB PMD mappings for the same request. All rows
+# go to one CSV file. Needs root.
+#
+#   ./run-bench.sh [-k memalloc.ko] [-p "params"] [-o out.csv]
+#
+# The sizes (in pages, at most 4096) and offsets (in pages from a 2 MiB
+# boundary) can be changed with environment variables, e.g.
+#   PAGES="512 4096" OFFSETS="0 1" ./run-bench.sh
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+MODULE="$HERE/../memalloc/memalloc.ko"
+PARAMS=""
+OUT=""
+
+PAGES=${PAGES:-"512 1024 2048 4096"}
+OFFSETS=${OFFSETS:-"0 1"}
+ROUNDS=${ROUNDS:-"10"}
+PASSES=${PASSES:-"16"}
+
+usage() {
+    sed -n '3,12p' "$0" | sed 's/^# \{0,1\}//'
+    exit 2
+}
+
+while getopts "k:p:o:h" opt; do
+    case $opt in
+        k) MODULE=$OPTARG ;;
+        p) PARAMS=$OPTARG ;;
+        o) OUT=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+[ "$(id -u)" -eq 0 ] || { echo "run-bench.sh must run as root" >&2; exit 1; }
+[ -x "$HERE/memalloc-bench" ] || make -C "$HERE" >&2
+[ -f "$MODULE" ] || { echo "$MODULE not found, build the module first" >&2; exit 1; }
+OUT=${OUT:-"memalloc-bench-$(date +%Y%m%d-%H%M%S).csv"}
+
+trap 'rmmod memalloc 2>/dev/null || true' EXIT
+
+# (Re)load memalloc with the given extra parameters
+load_memalloc() {
+    rmmod memalloc 2>/dev/null || true
+    # shellcheck disable=SC2086
+    insmod "$MODULE" $PARAMS "$@"
+    LABEL=$(echo "$PARAMS $*" | xargs | tr ' ,' '+;')
+    LABEL=${LABEL:-default}
+    echo "memalloc loaded, params: $LABEL" >&2
+}
+
+HEADER=-H
+: > "$OUT"
+
+for h in 0 1; do
+    load_memalloc huge="$h"
+    for pages in $PAGES; do
+        for offset in $OFFSETS; do
+            echo "memalloc-bench -n $pages -o $offset" >&2
+            "$HERE/memalloc-bench" $HEADER -L "$LABEL" -n "$pages" -o "$offset" \
+                -r "$ROUNDS" -t "$PASSES" >> "$OUT" || echo "  failed" >&2
+            HEADER=""
+        done
+    done
+done
+
+echo "results in $OUT" >&2
@@ -4,6 +4,34 @@
 /* Page table allocation helper functions defined in kmod_helper.c */
 pud_t*  memalloc_pud_alloc(p4d_t* p4d, unsigned long vaddr);
 pmd_t*  memalloc_pmd_alloc(pud_t* pud, unsigned long vaddr);
-void    memalloc_pte_alloc(pmd_t* pmd, unsigned long vaddr);
+pte_t*  memalloc_pte_alloc(pmd_t* pmd, unsigned long vaddr);
+bool    memalloc_pmd_map_huge(pmd_t* pmd, unsigned long vaddr, pgprot_t prot);
+pte_t*  memalloc_pte_lookup(struct mm_struct* mm, unsigned long vaddr);
+
+/* Batched range teardown defined in memalloc-helper.c */
+struct memalloc_gather {
+    struct mm_struct*   mm;
+    unsigned long       start;          /* range to flush */
+    unsigned long       end;
+    bool                freed_tables;   /* page tables were unhooked too */
+    unsigned long       nr_pages;       /* data pages collected */
+    struct list_head    pages;          /* freed after the flush */
+};
+
+void    memalloc_gather_init(struct memalloc_gather* tlb, struct mm_struct* mm);
+void    memalloc_gather_finish(struct memalloc_gather* tlb);
+void    memalloc_unmap_range(struct memalloc_gather* tlb, unsigned long addr, unsigned long end);
+
+/* Demand-paged allocations for lazy=1 defined in memalloc-lazy.c */
+bool    memalloc_lazy_enabled(void);
+int     memalloc_lazy_mmap(struct file* f, struct vm_area_struct* vma);
+int     memalloc_lazy_reserve(struct file* f, unsigned long vaddr, int num_pages, bool write);
+void    memalloc_lazy_release(unsigned long vaddr, int num_pages);
+void    memalloc_lazy_report(void);
+
+/* Pre-zeroed per-CPU page pools defined in memalloc-pool.c */
+bool    memalloc_pool_init(void);
+void    memalloc_pool_teardown(void);
+struct page* memalloc_pool_get_page(gfp_t gfp);
 
 #endif 
@@ -14,6 +14,8 @@
 #include <asm/pgtable.h>
 #include <asm/tlbflush.h>
 #include <linux/vmalloc.h>
+#include <linux/list.h>
+#include <linux/minmax.h>
 #include <asm/pgalloc.h>
 
 #include "memalloc-common.h"
@@ -65,12 +67,12 @@ pmd_t* memalloc_pmd_alloc(pud_t* pud, unsigned long vaddr) {
     return pmd;
 }
 
-void memalloc_pte_alloc(pmd_t* pmd, unsigned long vaddr) {
+pte_t* memalloc_pte_alloc(pmd_t* pmd, unsigned long vaddr) {
     gfp_t gfp = GFP_PGTABLE_USER;
     struct ptdesc* pte = (struct ptdesc*) pagetable_alloc(gfp, 0);
     if (!pte) {
         printk("Error: Failed to allocate PTE.\n");
-        return;
+        return NULL;
     }
 
     pgtable_t pt = ptdesc_page(pte);
@@ -86,4 +88,207 @@ void memalloc_pte_alloc(pmd_t* pmd, unsigned long vaddr) {
 		isb();
 	}
 #endif
+
+    return (pte_t*) ptdesc_address(pte);
+}
+
+/*
+ * Map the 2 MiB span at vaddr with one zeroed compound page at PMD level,
+ * saving the PTE table and leaving one TLB entry for the span. Fails
+ * quietly when no order-9 page is free so the caller can use 4 KiB pages.
+ */
+bool memalloc_pmd_map_huge(pmd_t* pmd, unsigned long vaddr, pgprot_t prot) {
+    gfp_t gfp = GFP_KERNEL_ACCOUNT | __GFP_ZERO | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY;
+    struct page* page = alloc_pages(gfp, PMD_SHIFT - PAGE_SHIFT);
+    if (!page)
+        return false;
+
+    set_pmd_at(current->mm, vaddr, pmd, pmd_mkhuge(pfn_pmd(page_to_pfn(page), prot)));
+    return true;
+}
+
+/* The PTE mapping vaddr if every table above it exists, without allocating any */
+pte_t* memalloc_pte_lookup(struct mm_struct* mm, unsigned long vaddr) {
+    pgd_t* pgd = pgd_offset(mm, vaddr);
+    p4d_t* p4d;
+    pud_t* pud;
+    pmd_t* pmd;
+
+    if (pgd_none(*pgd) || pgd_bad(*pgd))
+        return NULL;
+    p4d = p4d_offset(pgd, vaddr);
+    if (p4d_none(*p4d) || p4d_bad(*p4d))
+        return NULL;
+    pud = pud_offset(p4d, vaddr);
+    if (pud_none(*pud) || pud_bad(*pud))
+        return NULL;
+    pmd = pmd_offset(pud, vaddr);
+    if (pmd_none(*pmd) || pmd_bad(*pmd))
+        return NULL;
+    return pte_offset_kernel(pmd, vaddr);
+}
+
+/*
+ * Range teardown for FREE. Entries are cleared first and the data pages and
+ * emptied page tables collected on a list; memalloc_gather_finish() then
+ * issues one TLB flush for the whole range and only afterwards frees what
+ * was collected, so no CPU can still reach a page through a stale entry
+ * once it is back in the allocator. This is a small version of the
+ * kernel's mmu_gather, which modules can't use.
+ */
+void memalloc_gather_init(struct memalloc_gather* tlb, struct mm_struct* mm) {
+    tlb->mm = mm;
+    tlb->start = ULONG_MAX;
+    tlb->end = 0;
+    tlb->freed_tables = false;
+    tlb->nr_pages = 0;
+    INIT_LIST_HEAD(&tlb->pages);
+}
+
+static void memalloc_gather_page(struct memalloc_gather* tlb, struct page* page,
+                                 unsigned long addr, unsigned long size) {
+    list_add(&page->lru, &tlb->pages);
+    tlb->nr_pages += size >> PAGE_SHIFT;
+    tlb->start = min(tlb->start, addr);
+    tlb->end = max(tlb->end, addr + size);
+}
+
+/* Tables the kernel allocated carry a constructor, the ones from the helpers above don't */
+static void memalloc_gather_table(struct memalloc_gather* tlb, struct page* page, bool pmd_level) {
+    if (PageTable(page)) {
+        if (pmd_level)
+            pagetable_pmd_dtor(page_ptdesc(page));
+        else
+            pagetable_pte_dtor(page_ptdesc(page));
+    }
+    list_add(&page->lru, &tlb->pages);
+    tlb->freed_tables = true;
+}
+
+void memalloc_gather_finish(struct memalloc_gather* tlb) {
+    struct page *page, *tmp;
+
+    if (tlb->end > tlb->start) {
+#if defined(CONFIG_X86_64)
+        flush_tlb_mm_range(tlb->mm, tlb->start, tlb->end, PAGE_SHIFT, tlb->freed_tables);
+#else
+        /* Not a last-level flush, so cached walks through freed tables go too */
+        struct vm_area_struct vma = { .vm_mm = tlb->mm };
+        flush_tlb_range(&vma, tlb->start, tlb->end);
+#endif
+    }
+
+    list_for_each_entry_safe(page, tmp, &tlb->pages, lru) {
+        list_del(&page->lru);
+        __free_pages(page, compound_order(page));
+    }
+}
+
+/* A table can go once it maps nothing and no VMA could fault through it */
+static bool memalloc_table_unused(struct mm_struct* mm, unsigned long start, unsigned long size) {
+    return !find_vma_intersection(mm, start, start + size);
+}
+
+static void memalloc_free_pte_table(struct memalloc_gather* tlb, pmd_t* pmd, unsigned long addr) {
+    unsigned long start = addr & PMD_MASK;
+    pte_t* pte = pte_offset_kernel(pmd, start);
+    struct page* page;
+    int i;
+
+    for (i = 0; i < PTRS_PER_PTE; i++)
+        if (!pte_none(pte[i]))
+            return;
+    if (!memalloc_table_unused(tlb->mm, start, PMD_SIZE))
+        return;
+
+    page = pmd_page(*pmd);
+    pmd_clear(pmd);
+    memalloc_gather_table(tlb, page, false);
+}
+
+static void memalloc_free_pmd_table(struct memalloc_gather* tlb, pud_t* pud, unsigned long addr) {
+    unsigned long start = addr & PUD_MASK;
+    pmd_t* pmd = pmd_offset(pud, start);
+    int i;
+
+    for (i = 0; i < PTRS_PER_PMD; i++)
+        if (!pmd_none(pmd[i]))
+            return;
+    if (!memalloc_table_unused(tlb->mm, start, PUD_SIZE))
+        return;
+
+    pud_clear(pud);
+    memalloc_gather_table(tlb, virt_to_page(pmd), true);
+}
+
+static void memalloc_unmap_pte_range(struct memalloc_gather* tlb, pmd_t* pmd,
+                                     unsigned long addr, unsigned long end) {
+    pte_t* pte = pte_offset_kernel(pmd, addr);
+    pte_t old;
+
+    for (; addr != end; pte++, addr += PAGE_SIZE) {
+        old = ptep_get_and_clear(tlb->mm, addr, pte);
+        if (!pte_none(old))
+            memalloc_gather_page(tlb, pte_page(old), addr, PAGE_SIZE);
+    }
+}
+
+static void memalloc_unmap_pmd_range(struct memalloc_gather* tlb, pud_t* pud,
+                                     unsigned long addr, unsigned long end) {
+    pmd_t* pmd = pmd_offset(pud, addr);
+    unsigned long next;
+
+    pmd_t old;
+
+    do {
+        next = pmd_addr_end(addr, end);
+
+        /* Huge pages are only ever installed for whole spans, so they go whole */
+        if (pmd_leaf(*pmd)) {
+            old = *pmd;
+            pmd_clear(pmd);
+            memalloc_gather_page(tlb, pmd_page(old), addr & PMD_MASK, PMD_SIZE);
+            continue;
+        }
+        if (pmd_none(*pmd) || pmd_bad(*pmd))
+            continue;
+        memalloc_unmap_pte_range(tlb, pmd, addr, next);
+        memalloc_free_pte_table(tlb, pmd, addr);
+    } while (pmd++, addr = next, addr != end);
+}
+
+/* PUD and higher tables span 512 GiB or more and are left in place */
+static void memalloc_unmap_pud_range(struct memalloc_gather* tlb, p4d_t* p4d,
+                                     unsigned long addr, unsigned long end) {
+    pud_t* pud = pud_offset(p4d, addr);
+    unsigned long next;
+
+    do {
+        next = pud_addr_end(addr, end);
+        if (pud_none(*pud) || pud_bad(*pud))
+            continue;
+        memalloc_unmap_pmd_range(tlb, pud, addr, next);
+        memalloc_free_pmd_table(tlb, pud, addr);
+    } while (pud++, addr = next, addr != end);
+}
+
+/* Clear every mapping in [addr, end) and collect its pages, the caller holds the mmap lock */
+void memalloc_unmap_range(struct memalloc_gather* tlb, unsigned long addr, unsigned long end) {
+    pgd_t* pgd = pgd_offset(tlb->mm, addr);
+    unsigned long next, p4d_next;
+    p4d_t* p4d;
+
+    do {
+        next = pgd_addr_end(addr, end);
+        if (pgd_none(*pgd) || pgd_bad(*pgd))
+            continue;
+
+        p4d = p4d_offset(pgd, addr);
+        do {
+            p4d_next = p4d_addr_end(addr, next);
+            if (p4d_none(*p4d) || p4d_bad(*p4d))
+                continue;
+            memalloc_unmap_pud_range(tlb, p4d, addr, p4d_next);
+        } while (p4d++, addr = p4d_next, addr != next);
+    } while (pgd++, addr = next, addr != end);
 }
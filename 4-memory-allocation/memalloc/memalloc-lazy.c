@@ -0,0 +1,177 @@
+/* General headers */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/minmax.h>
+#include <linux/sched.h>
+
+#include "memalloc-common.h"
+
+/*
+ * Demand-paged allocations for lazy=1. ALLOCATE only reserves the range:
+ * it maps /dev/memalloc over it with MAP_FIXED_NOREPLACE, so the range gets
+ * a VMA of its own and counts against the page budget, but no page is
+ * allocated until the process first touches it. The fault handler then
+ * allocates, zeroes and maps the page, together with up to fault_around
+ * neighbouring pages in the same aligned window that aren't mapped yet.
+ * Pages are inserted with vm_insert_page(), so the VMA owns them and
+ * munmap(), FREE or process exit releases them like any other mapping.
+ * FREE only unmaps what is still a memalloc reservation.
+ * Write access needs /dev/memalloc opened read-write, as for any shared
+ * mapping.
+ */
+
+/* Reserve at ALLOCATE and allocate pages on first touch */
+static bool lazy = false;
+module_param(lazy, bool, S_IRUGO);
+
+/* Pages mapped per fault, rounded down to a power of two, 1 maps only the faulting page */
+static unsigned int fault_around = 1;
+module_param(fault_around, uint, S_IRUGO);
+
+/* The task inside ALLOCATE's vm_mmap(), the only one allowed to map the device */
+static struct task_struct *lazy_mapper;
+
+static atomic_long_t lazy_faults = ATOMIC_LONG_INIT(0);
+static atomic_long_t lazy_pages = ATOMIC_LONG_INIT(0);
+
+bool memalloc_lazy_enabled(void) {
+    return lazy;
+}
+
+/* Allocate, zero and map one page, the VMA takes its own reference */
+static int memalloc_lazy_insert(struct vm_area_struct *vma, unsigned long addr) {
+    struct page *page = memalloc_pool_get_page(GFP_HIGHUSER | __GFP_ACCOUNT);
+    int err;
+
+    if (!page)
+        return -ENOMEM;
+
+    err = vm_insert_page(vma, addr, page);
+    put_page(page);
+    if (!err)
+        atomic_long_inc(&lazy_pages);
+    return err;
+}
+
+static vm_fault_t memalloc_lazy_fault(struct vm_fault *vmf) {
+    struct vm_area_struct *vma = vmf->vma;
+    unsigned long addr = vmf->address & PAGE_MASK;
+    unsigned long window, start, end;
+    pte_t *pte;
+    int err;
+
+    atomic_long_inc(&lazy_faults);
+
+    /* The faulting page itself; -EBUSY means a racing fault got there first */
+    err = memalloc_lazy_insert(vma, addr);
+    if (err == -ENOMEM)
+        return VM_FAULT_OOM;
+    if (err && err != -EBUSY)
+        return VM_FAULT_SIGBUS;
+
+    /*
+     * The aligned window around it, clamped to the VMA. The window never
+     * crosses a PMD, so one PTE table tells which neighbours are still
+     * empty; a stale answer only costs a page that vm_insert_page() refuses.
+     */
+    window = rounddown_pow_of_two(clamp_val(fault_around, 1, PTRS_PER_PTE)) << PAGE_SHIFT;
+    if (window == PAGE_SIZE)
+        return VM_FAULT_NOPAGE;
+
+    start = max(addr & ~(window - 1), vma->vm_start);
+    end = min((addr & ~(window - 1)) + window, vma->vm_end);
+    pte = memalloc_pte_lookup(vma->vm_mm, start);
+    if (!pte)
+        return VM_FAULT_NOPAGE;
+
+    for (; start < end; start += PAGE_SIZE, pte++) {
+        if (start == addr || !pte_none(ptep_get(pte)))
+            continue;
+        if (memalloc_lazy_insert(vma, start))
+            break;
+    }
+
+    return VM_FAULT_NOPAGE;
+}
+
+static const struct vm_operations_struct memalloc_lazy_vm_ops = {
+    .fault = memalloc_lazy_fault,
+};
+
+/* mmap of /dev/memalloc, only reachable through ALLOCATE in lazy mode */
+int memalloc_lazy_mmap(struct file *f, struct vm_area_struct *vma) {
+    if (!lazy || READ_ONCE(lazy_mapper) != current)
+        return -EPERM;
+
+    /* Faults insert pages one by one, the range can't be grown or dumped */
+    vm_flags_set(vma, VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_ops = &memalloc_lazy_vm_ops;
+    return 0;
+}
+
+/* Give [vaddr, vaddr + num_pages) its own VMA, -1 if anything is mapped there */
+int memalloc_lazy_reserve(struct file *f, unsigned long vaddr, int num_pages, bool write) {
+    unsigned long prot = PROT_READ | (write ? PROT_WRITE : 0);
+    unsigned long addr;
+
+    WRITE_ONCE(lazy_mapper, current);
+    addr = vm_mmap(f, vaddr, (unsigned long)num_pages << PAGE_SHIFT, prot,
+                   MAP_SHARED | MAP_FIXED_NOREPLACE, 0);
+    WRITE_ONCE(lazy_mapper, NULL);
+
+    if ((long)addr == -EEXIST)
+        return -1;  /* Memory already mapped */
+    if (IS_ERR_VALUE(addr))
+        return (int)addr;
+    if (addr != vaddr) {
+        vm_munmap(addr, (unsigned long)num_pages << PAGE_SHIFT);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Whether every mapping in [start, end) of mm is a reservation of ours */
+static bool memalloc_lazy_owns(struct mm_struct *mm, unsigned long start, unsigned long end) {
+    struct vm_area_struct *vma;
+    VMA_ITERATOR(vmi, mm, start);
+    bool owned = true;
+
+    mmap_read_lock(mm);
+    for_each_vma_range(vmi, vma, end) {
+        if (vma->vm_ops != &memalloc_lazy_vm_ops) {
+            owned = false;
+            break;
+        }
+    }
+    mmap_read_unlock(mm);
+
+    return owned;
+}
+
+/*
+ * Drop a reservation of the current process and every page faulted into it.
+ * The process may have unmapped it itself and put something else there
+ * since, so the range is only unmapped while everything in it is still ours;
+ * otherwise only the accounting goes.
+ */
+void memalloc_lazy_release(unsigned long vaddr, int num_pages) {
+    unsigned long len = (unsigned long)num_pages << PAGE_SHIFT;
+
+    if (!memalloc_lazy_owns(current->mm, vaddr, vaddr + len)) {
+        printk("Reservation at %lx was replaced, leaving the mapping alone\n", vaddr);
+        return;
+    }
+    vm_munmap(vaddr, len);
+}
+
+void memalloc_lazy_report(void) {
+    if (lazy)
+        printk("Lazy allocation: %ld faults mapped %ld pages\n",
+               atomic_long_read(&lazy_faults), atomic_long_read(&lazy_pages));
+}
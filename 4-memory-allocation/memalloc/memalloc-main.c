@@ -14,6 +14,7 @@
 #include <asm/pgtable.h>
 #include <asm/tlbflush.h>
 #include <linux/vmalloc.h>
+#include <linux/slab.h>
 #include <asm/pgalloc.h>
 /* File IO-related headers */
 #include <linux/fs.h>
@@ -46,6 +47,10 @@ void memalloc_ioctl_teardown(void);
 #define DEVICE_NAME         "memalloc"
 #define DEVICE_CLASS        "memalloc"
 
+/* Map whole aligned 2 MiB spans of a request with one PMD-level huge page */
+static bool huge = true;
+module_param(huge, bool, S_IRUGO);
+
 #if defined(CONFIG_X86_64)
     #define PAGE_PERMS_RW   PAGE_SHARED
     #define PAGE_PERMS_R    PAGE_READONLY
@@ -66,68 +71,253 @@ static struct device *device = NULL;
 static int total_pages_allocated = 0;
 static int total_allocations = 0;
 
-/* Function to check if memory is already mapped */
-static int is_memory_mapped(unsigned long vaddr, int num_pages) {
-    pgd_t *pgd;
-    p4d_t *p4d;
-    pud_t *pud;
-    pmd_t *pmd;
-    pte_t *pte;
-    unsigned long addr;
-    
-    /* Iterate through each page in the requested range */
-    for (addr = vaddr; addr < vaddr + (num_pages * PAGE_SIZE); addr += PAGE_SIZE) {
-        /* Get the PGD (top-level page directory) */
-        pgd = pgd_offset(current->mm, addr);
-        if (pgd_none(*pgd) || pgd_bad(*pgd)) {
-            /* This page is not mapped */
-            continue;
-        }
+/* One live allocation, kept so FREE can find its size and owner */
+struct memalloc_region {
+    struct mm_struct *mm;
+    unsigned long vaddr;
+    int num_pages;
+    bool lazy;          /* reserved by lazy=1, the VMA owns the pages */
+    struct page **pages;    /* what was mapped, a huge page once by its head */
+    int nr_pages;
+};
+
+static struct memalloc_region regions[MAX_ALLOCATIONS];
+
+/* Serializes requests: the counters, the region table and alloc_req/free_req */
+static DEFINE_MUTEX(memalloc_lock);
+
+/* Unmap and free [start, end) of mm with one TLB flush, mmap lock held */
+static unsigned long release_range(struct mm_struct *mm, unsigned long start, unsigned long end) {
+    struct memalloc_gather tlb;
+    
+    memalloc_gather_init(&tlb, mm);
+    memalloc_unmap_range(&tlb, start, end);
+    memalloc_gather_finish(&tlb);
+    
+    return tlb.nr_pages;
+}
+
+/*
+ * Free the pages of a region whose process has exited. exit_mmap() only
+ * tears down what lies under a VMA, so the pages are still ours, but it may
+ * already have freed page tables around the range, so the tables are not
+ * walked again. The pages are freed from the list taken at ALLOCATE; page
+ * tables that exit_mmap() left in place are not freed and stay allocated
+ * until reboot.
+ */
+static void release_exited_pages(struct memalloc_region *region) {
+    int i;
+    
+    for (i = 0; i < region->nr_pages; i++)
+        __free_pages(region->pages[i], compound_order(region->pages[i]));
+}
+
+/* Free a region's pages and page tables and return its pages to the budget */
+static void release_region(struct memalloc_region *region) {
+    unsigned long freed;
+    
+    if (region->lazy) {
+        /* A reservation goes with its VMA, exit_mmap() already took it from exited processes */
+        if (region->mm == current->mm)
+            memalloc_lazy_release(region->vaddr, region->num_pages);
+    } else if (!atomic_read(&region->mm->mm_users)) {
+        release_exited_pages(region);
+    } else {
+        mmap_write_lock(region->mm);
+        freed = release_range(region->mm, region->vaddr, region->vaddr + region->num_pages * PAGE_SIZE);
+        mmap_write_unlock(region->mm);
         
-        /* Level 2: P4D */
-        p4d = p4d_offset(pgd, addr);
-        if (p4d_none(*p4d) || p4d_bad(*p4d)) {
-            /* This page is not mapped */
-            continue;
+        if (freed != region->num_pages)
+            printk("Warning: %lu of %d pages were still mapped at %lx\n", 
+                   freed, region->num_pages, region->vaddr);
+    }
+    
+    total_pages_allocated -= region->num_pages;
+    total_allocations--;
+    mmdrop(region->mm);
+    kvfree(region->pages);
+    region->pages = NULL;
+    region->mm = NULL;
+    region->vaddr = 0;
+}
+
+/* Regions of processes that exited without FREE go back to the budget */
+static void reap_exited_regions(void) {
+    int i;
+    
+    for (i = 0; i < MAX_ALLOCATIONS; i++)
+        if (regions[i].mm && !atomic_read(&regions[i].mm->mm_users))
+            release_region(&regions[i]);
+}
+
+/* The region of mm starting at vaddr, (NULL, 0) finds a free slot */
+static struct memalloc_region *find_region(struct mm_struct *mm, unsigned long vaddr) {
+    int i;
+    
+    for (i = 0; i < MAX_ALLOCATIONS; i++)
+        if (regions[i].mm == mm && regions[i].vaddr == vaddr)
+            return &regions[i];
+    return NULL;
+}
+
+/*
+ * One pass over the requested range that both checks and populates it.
+ * Each level is descended once per entry rather than once per page, and
+ * missing tables are allocated on the way down. A freshly allocated PTE
+ * table is known to be empty, so its PTEs are filled without being
+ * checked, while an existing one is checked and filled in the same tight
+ * loop. The walk stops at the first page that is already mapped and
+ * records where, so the caller can roll back exactly what it mapped.
+ */
+struct populate_walk {
+    struct mm_struct *mm;
+    pgprot_t prot;
+    struct page **pages;        /* every page mapped, huge pages by their head */
+    int nr_pages;
+    unsigned long stopped;      /* address the walk failed at */
+    int pages_allocated;
+    int huge_allocated;
+};
+
+static int populate_fail(struct populate_walk *walk, unsigned long addr, int ret) {
+    walk->stopped = addr;
+    return ret;
+}
+
+/* Level 5: PTE (final level page table) */
+static int populate_pte_range(struct populate_walk *walk, pmd_t *pmd, 
+                              unsigned long addr, unsigned long end, bool empty) {
+    pte_t *pte = pte_offset_kernel(pmd, addr);
+    struct page *page;
+    
+    for (; addr != end; pte++, addr += PAGE_SIZE) {
+        if (!empty && !pte_none(*pte))
+            return populate_fail(walk, addr, -1);  /* Page is already mapped */
+        
+        /* Take a zeroed page, pre-zeroed from the pool when there is one */
+        page = memalloc_pool_get_page(GFP_KERNEL_ACCOUNT);
+        if (!page) {
+            printk("Failed to get a page from the freelist\n");
+            return populate_fail(walk, addr, -ENOMEM);
         }
         
-        /* Level 3: PUD */
-        pud = pud_offset(p4d, addr);
-        if (pud_none(*pud) || pud_bad(*pud)) {
-            /* This page is not mapped */
-            continue;
+        /* Map the page with appropriate permissions */
+        set_pte_at(walk->mm, addr, pte, pfn_pte(page_to_pfn(page), walk->prot));
+        walk->pages[walk->nr_pages++] = page;
+        walk->pages_allocated++;
+    }
+    
+    return 0;
+}
+
+/* Level 4: PMD */
+static int populate_pmd_range(struct populate_walk *walk, pud_t *pud, 
+                              unsigned long addr, unsigned long end) {
+    pmd_t *pmd = pmd_offset(pud, addr);
+    unsigned long next;
+    bool fresh;
+    int ret;
+    
+    do {
+        next = pmd_addr_end(addr, end);
+        fresh = false;
+        
+        if (pmd_none(*pmd)) {
+            /* A whole aligned 2 MiB span needs no PTE table, just a huge page */
+            if (huge && next - addr == PMD_SIZE && memalloc_pmd_map_huge(pmd, addr, walk->prot)) {
+                walk->pages[walk->nr_pages++] = pmd_page(*pmd);
+                walk->pages_allocated += PTRS_PER_PMD;
+                walk->huge_allocated++;
+                continue;
+            }
+            if (!memalloc_pte_alloc(pmd, addr))
+                return populate_fail(walk, addr, -ENOMEM);
+            fresh = true;
+        } else if (pmd_leaf(*pmd) || pmd_bad(*pmd)) {
+            return populate_fail(walk, addr, -1);  /* A huge page maps this span */
         }
         
-        /* Level 4: PMD */
-        pmd = pmd_offset(pud, addr);
-        if (pmd_none(*pmd) || pmd_bad(*pmd)) {
-            /* This page is not mapped */
-            continue;
+        ret = populate_pte_range(walk, pmd, addr, next, fresh);
+        if (ret)
+            return ret;
+    } while (pmd++, addr = next, addr != end);
+    
+    return 0;
+}
+
+/* Level 3: PUD */
+static int populate_pud_range(struct populate_walk *walk, p4d_t *p4d, 
+                              unsigned long addr, unsigned long end) {
+    pud_t *pud = pud_offset(p4d, addr);
+    unsigned long next;
+    int ret;
+    
+    do {
+        next = pud_addr_end(addr, end);
+        
+        if (pud_none(*pud)) {
+            if (!memalloc_pmd_alloc(pud, addr))
+                return populate_fail(walk, addr, -ENOMEM);
+        } else if (pud_leaf(*pud) || pud_bad(*pud)) {
+            return populate_fail(walk, addr, -1);
         }
         
-        /* Level 5: PTE (final level page table) */
-        pte = pte_offset_kernel(pmd, addr);
-        if (!pte_none(*pte)) {
-            /* Page is already mapped */
-            return 1;  /* At least one page is already mapped */
+        ret = populate_pmd_range(walk, pud, addr, next);
+        if (ret)
+            return ret;
+    } while (pud++, addr = next, addr != end);
+    
+    return 0;
+}
+
+/* Levels 1 and 2: PGD and P4D */
+static int populate_range(struct populate_walk *walk, unsigned long addr, unsigned long end) {
+    pgd_t *pgd = pgd_offset(walk->mm, addr);
+    unsigned long next, p4d_next;
+    p4d_t *p4d;
+    int ret;
+    
+    do {
+        next = pgd_addr_end(addr, end);
+        if (pgd_none(*pgd) || pgd_bad(*pgd)) {
+            printk("Error: No P4D table for address %lx.\n", addr);
+            return populate_fail(walk, addr, -EFAULT);
         }
-    }
+        
+        p4d = p4d_offset(pgd, addr);
+        do {
+            p4d_next = p4d_addr_end(addr, next);
+            
+            if (p4d_none(*p4d)) {
+                if (!memalloc_pud_alloc(p4d, addr))
+                    return populate_fail(walk, addr, -ENOMEM);
+            } else if (p4d_bad(*p4d)) {
+                return populate_fail(walk, addr, -1);
+            }
+            
+            ret = populate_pud_range(walk, p4d, addr, p4d_next);
+            if (ret)
+                return ret;
+        } while (p4d++, addr = p4d_next, addr != next);
+    } while (pgd++, addr = next, addr != end);
     
-    return 0;  /* None of the pages are mapped */
+    return 0;
 }
 
 /* Function to allocate memory pages */
-static int allocate_memory(unsigned long vaddr, int num_pages, bool write) {
-    pgd_t *pgd;
-    p4d_t *p4d;
-    pud_t *pud;
-    pmd_t *pmd;
-    pte_t *pte;
-    unsigned long addr;
-    void *page_vaddr;
-    unsigned long page_paddr;
-    gfp_t gfp = GFP_KERNEL_ACCOUNT;
-    int pages_allocated = 0;
+static int allocate_memory(struct file *f, unsigned long vaddr, int num_pages, bool write) {
+    struct populate_walk walk = {
+        .mm     = current->mm,
+        .prot   = write ? PAGE_PERMS_RW : PAGE_PERMS_R,
+    };
+    struct memalloc_region *region;
+    int ret;
+    
+    if (num_pages <= 0)
+        return -EINVAL;
+    
+    /* Pages of processes that exited since the last request count again */
+    reap_exited_regions();
     
     /* Check allocation limits */
     if (total_pages_allocated + num_pages > MAX_PAGES) {
@@ -142,82 +332,78 @@ static int allocate_memory(unsigned long vaddr, int num_pages, bool write) {
         return -3;  /* Allocation count exceeded */
     }
     
-    /* Check if memory is already mapped */
-    if (is_memory_mapped(vaddr, num_pages)) {
-        printk("Error: Memory region already mapped.\n");
-        return -1;  /* Memory already mapped */
-    }
-    
-    /* Allocate each page */
-    for (addr = vaddr; addr < vaddr + (num_pages * PAGE_SIZE); addr += PAGE_SIZE) {
-        /* Get the PGD (top-level page directory) */
-        pgd = pgd_offset(current->mm, addr);
-        
-        /* Level 2: P4D */
-        p4d = p4d_offset(pgd, addr);
-        if (p4d_none(*p4d)) {
-            memalloc_pud_alloc(p4d, addr);
-            p4d = p4d_offset(pgd, addr);
-        }
-        
-        /* Level 3: PUD */
-        pud = pud_offset(p4d, addr);
-        if (pud_none(*pud)) {
-            memalloc_pmd_alloc(pud, addr);
-            pud = pud_offset(p4d, addr);
-        }
-        
-        /* Level 4: PMD */
-        pmd = pmd_offset(pud, addr);
-        if (pmd_none(*pmd)) {
-            memalloc_pte_alloc(pmd, addr);
-            pmd = pmd_offset(pud, addr);
-        }
-        
-        /* Level 5: PTE (final level page table) */
-        pte = pte_offset_kernel(pmd, addr);
-        
-        /* Allocate a new page */
-        page_vaddr = (void *)get_zeroed_page(gfp);
-        if (!page_vaddr) {
-            printk("Failed to get a page from the freelist\n");
+    if (memalloc_lazy_enabled()) {
+        /* Only reserve the range, pages are allocated on first touch */
+        ret = memalloc_lazy_reserve(f, vaddr, num_pages, write);
+    } else {
+        /* Kept so the pages can be freed without a walk if the process exits */
+        walk.pages = kvmalloc_array(num_pages, sizeof(*walk.pages), GFP_KERNEL);
+        if (!walk.pages)
             return -ENOMEM;
-        }
-        
-        /* Get physical address */
-        page_paddr = __pa(page_vaddr);
         
-        /* Map the page with appropriate permissions */
-        if (write) {
-            set_pte_at(current->mm, addr, pte, 
-                      pfn_pte((page_paddr >> PAGE_SHIFT), PAGE_PERMS_RW));
-        } else {
-            set_pte_at(current->mm, addr, pte, 
-                      pfn_pte((page_paddr >> PAGE_SHIFT), PAGE_PERMS_R));
-        }
-        pages_allocated++;
+        /* Check and populate the range in one walk, undoing it if any page was mapped */
+        mmap_write_lock(current->mm);
+        ret = populate_range(&walk, vaddr, vaddr + (num_pages * PAGE_SIZE));
+        if (ret)
+            release_range(current->mm, vaddr, walk.stopped);
+        mmap_write_unlock(current->mm);
+    }
+    
+    if (ret == -1)
+        printk("Error: Memory region already mapped.\n");
+    if (ret) {
+        kvfree(walk.pages);
+        return ret;
     }
     
-    /* Update allocation counters */
-    total_pages_allocated += pages_allocated;
+    /* Remember the region for FREE */
+    region = find_region(NULL, 0);
+    mmgrab(current->mm);
+    region->mm = current->mm;
+    region->vaddr = vaddr;
+    region->num_pages = num_pages;
+    region->lazy = memalloc_lazy_enabled();
+    region->pages = walk.pages;
+    region->nr_pages = walk.nr_pages;
+    
+    /* Update allocation counters, a reservation counts in full */
+    total_pages_allocated += num_pages;
     total_allocations++;
     
-    printk("Successfully allocated %d pages at address %lx with %s permissions\n", 
-           pages_allocated, vaddr, write ? "read-write" : "read-only");
+    if (region->lazy) {
+        printk("Successfully reserved %d pages at address %lx with %s permissions\n", 
+               num_pages, vaddr, write ? "read-write" : "read-only");
+        return 0;
+    }
+    
+    printk("Successfully allocated %d pages (%d huge) at address %lx with %s permissions\n", 
+           walk.pages_allocated, walk.huge_allocated, vaddr, write ? "read-write" : "read-only");
     
     return 0;  /* Success */
 }
 
 /* Function to free allocated memory */
 static int free_memory(unsigned long vaddr) {
-    /* Implement free functionality if needed */
-    /* For this assignment, we'll just print the message and return success */
-    printk("Free request for address %lx\n", vaddr);
-    return 0;
+    struct memalloc_region *region;
+    int num_pages;
+    
+    /* Only the start of an allocation made by this process can be freed */
+    region = find_region(current->mm, vaddr);
+    if (!region) {
+        printk("Error: No allocation at address %lx.\n", vaddr);
+        return -1;  /* Not allocated */
+    }
+    
+    num_pages = region->num_pages;
+    release_region(region);
+    
+    printk("Successfully freed %d pages at address %lx\n", num_pages, vaddr);
+    
+    return 0;  /* Success */
 }
 
-/* IOCTL handler for vmod. */
-static long memalloc_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
+/* Request dispatch, called with memalloc_lock held */
+static long memalloc_ioctl_locked(struct file *f, unsigned int cmd, unsigned long arg) {
     int ret = 0;
     
     switch (cmd) {
@@ -231,7 +417,7 @@ static long memalloc_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
         printk("IOCTL: alloc(%lx, %d, %d)\n", alloc_req.vaddr, alloc_req.num_pages, alloc_req.write);
         
         /* Allocate the requested memory */
-        ret = allocate_memory(alloc_req.vaddr, alloc_req.num_pages, alloc_req.write);
+        ret = allocate_memory(f, alloc_req.vaddr, alloc_req.num_pages, alloc_req.write);
         break;
         
     case FREE:
@@ -255,10 +441,22 @@ static long memalloc_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
     return ret;
 }
 
+/* IOCTL handler for vmod. */
+static long memalloc_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
+    int ret = 0;
+    
+    mutex_lock(&memalloc_lock);
+    ret = memalloc_ioctl_locked(f, cmd, arg);
+    mutex_unlock(&memalloc_lock);
+    
+    return ret;
+}
+
 /* Required file ops. */
 static struct file_operations fops = {
     .owner          = THIS_MODULE,
     .unlocked_ioctl = memalloc_ioctl,
+    .mmap           = memalloc_lazy_mmap,
 };
 
 /* Initialize the module for IOCTL commands */
@@ -309,9 +507,17 @@ void memalloc_ioctl_teardown(void) {
 static int __init memalloc_module_init(void) {
     printk("Hello from the memalloc module!\n");
     
+    /* Initialize the pre-zeroed page pools */
+    if (!memalloc_pool_init()) {
+        printk("Failed to initialize page pools\n");
+        memalloc_pool_teardown();
+        return -1;
+    }
+    
     /* Initialize IOCTL interface */
     if (!memalloc_ioctl_init()) {
         printk("Failed to initialize IOCTL interface\n");
+        memalloc_pool_teardown();
         return -1;
     }
     
@@ -320,9 +526,24 @@ static int __init memalloc_module_init(void) {
 }
 
 static void __exit memalloc_module_exit(void) {
+    int i;
+    
     /* Teardown IOCTL */
     memalloc_ioctl_teardown();
     
+    /* Free what exited processes left behind, live processes keep their pages */
+    reap_exited_regions();
+    for (i = 0; i < MAX_ALLOCATIONS; i++) {
+        if (regions[i].mm) {
+            mmdrop(regions[i].mm);
+            kvfree(regions[i].pages);
+        }
+    }
+    memalloc_lazy_report();
+    
+    /* Teardown the page pools */
+    memalloc_pool_teardown();
+    
     printk("Goodbye from the memalloc module!\n");
 }
 
@@ -0,0 +1,237 @@
+/* General headers */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/gfp.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/minmax.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#include "memalloc-common.h"
+
+/*
+ * Per-CPU pools of pre-zeroed pages, so ALLOCATE and lazy faults don't pay
+ * for zeroing inline. A request takes pages from the pool of the CPU it
+ * runs on and falls back to the buddy allocator when that pool is empty.
+ * Once a pool drops below pool_low pages a kthread running at the lowest
+ * priority refills it to pool_high, allocating and zeroing outside the
+ * pool lock, on the memory node of the CPU the pool belongs to. Fill
+ * levels, hit rate and refill latency are in /sys/kernel/debug/memalloc/pool.
+ *
+ * Pool pages are allocated by the kthread and can't be charged to the
+ * memory cgroup of the process that ends up with them (modules have no way
+ * to charge a page after the fact), so the pools are off unless pool_high
+ * is set; without them every page is a __GFP_ACCOUNT allocation charged to
+ * the caller.
+ */
+
+/* Refill a CPU's pool once it holds fewer pages than this */
+static unsigned int pool_low = 64;
+module_param(pool_low, uint, S_IRUGO);
+
+/* Pages per CPU the refill thread fills up to, 0 (the default) disables the pools */
+static unsigned int pool_high = 0;
+module_param(pool_high, uint, S_IRUGO);
+
+#define POOL_REFILL_BATCH   32
+
+struct memalloc_pool {
+    spinlock_t          lock;
+    struct list_head    pages;
+    unsigned int        count;
+    unsigned long       hits;
+    unsigned long       misses;
+    /* Refills of this pool, updated by the refill thread only */
+    unsigned long       refills;
+    u64                 refill_ns;
+    u64                 refill_max_ns;
+};
+
+static DEFINE_PER_CPU(struct memalloc_pool, pools);
+static DECLARE_WAIT_QUEUE_HEAD(refill_wait);
+static atomic_t refill_pending = ATOMIC_INIT(0);
+static struct task_struct *refill_thread;
+static struct dentry *pool_debugfs;
+
+static void memalloc_pool_kick(void) {
+    if (!atomic_xchg(&refill_pending, 1))
+        wake_up(&refill_wait);
+}
+
+/* A zeroed page, from this CPU's pool when it has one */
+struct page* memalloc_pool_get_page(gfp_t gfp) {
+    struct memalloc_pool *pool;
+    struct page *page = NULL;
+    bool low;
+
+    if (pool_high) {
+        pool = raw_cpu_ptr(&pools);
+        spin_lock(&pool->lock);
+        page = list_first_entry_or_null(&pool->pages, struct page, lru);
+        if (page) {
+            list_del(&page->lru);
+            pool->count--;
+            pool->hits++;
+        } else {
+            pool->misses++;
+        }
+        low = pool->count < pool_low;
+        spin_unlock(&pool->lock);
+
+        if (low)
+            memalloc_pool_kick();
+        if (page)
+            return page;
+    }
+
+    return alloc_page(gfp | __GFP_ZERO);
+}
+
+/* Fill one CPU's pool to pool_high, allocating in batches outside the lock */
+static void memalloc_pool_refill(struct memalloc_pool *pool, int cpu) {
+    u64 start = ktime_get_ns(), elapsed;
+    struct page *page;
+    unsigned int want, n;
+    LIST_HEAD(batch);
+
+    for (;;) {
+        spin_lock(&pool->lock);
+        want = pool->count < pool_high ? pool_high - pool->count : 0;
+        spin_unlock(&pool->lock);
+        if (!want)
+            break;
+
+        want = min_t(unsigned int, want, POOL_REFILL_BATCH);
+        for (n = 0; n < want; n++) {
+            page = alloc_pages_node(cpu_to_node(cpu), GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN, 0);
+            if (!page)
+                break;
+            list_add(&page->lru, &batch);
+        }
+
+        spin_lock(&pool->lock);
+        list_splice_init(&batch, &pool->pages);
+        pool->count += n;
+        spin_unlock(&pool->lock);
+
+        if (n < want || kthread_should_stop())
+            break;
+        cond_resched();
+    }
+
+    elapsed = ktime_get_ns() - start;
+    pool->refills++;
+    pool->refill_ns += elapsed;
+    pool->refill_max_ns = max(pool->refill_max_ns, elapsed);
+}
+
+static int memalloc_pool_thread(void *data) {
+    struct memalloc_pool *pool;
+    int cpu;
+
+    /* Zeroing ahead of time must never compete with real work */
+    set_user_nice(current, MAX_NICE);
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(refill_wait,
+                                 atomic_read(&refill_pending) || kthread_should_stop());
+        atomic_set(&refill_pending, 0);
+
+        for_each_online_cpu(cpu) {
+            pool = per_cpu_ptr(&pools, cpu);
+            if (READ_ONCE(pool->count) < pool_low || !pool->refills)
+                memalloc_pool_refill(pool, cpu);
+            if (kthread_should_stop())
+                break;
+        }
+    }
+
+    return 0;
+}
+
+static int memalloc_pool_show(struct seq_file *m, void *v) {
+    unsigned long hits = 0, misses = 0;
+    struct memalloc_pool *pool;
+    int cpu;
+
+    seq_printf(m, "low %u\nhigh %u\n", pool_low, pool_high);
+    seq_printf(m, "%-4s %8s %12s %12s %8s %14s %14s\n",
+               "cpu", "pages", "hits", "misses", "refills", "avg_refill_ns", "max_refill_ns");
+    for_each_possible_cpu(cpu) {
+        pool = per_cpu_ptr(&pools, cpu);
+        spin_lock(&pool->lock);
+        seq_printf(m, "%-4d %8u %12lu %12lu %8lu %14llu %14llu\n", cpu, pool->count,
+                   pool->hits, pool->misses, pool->refills,
+                   pool->refills ? div64_u64(pool->refill_ns, pool->refills) : 0,
+                   pool->refill_max_ns);
+        hits += pool->hits;
+        misses += pool->misses;
+        spin_unlock(&pool->lock);
+    }
+    seq_printf(m, "hit_rate %lu%%\n", hits + misses ? hits * 100 / (hits + misses) : 0);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(memalloc_pool);
+
+bool memalloc_pool_init(void) {
+    struct memalloc_pool *pool;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        pool = per_cpu_ptr(&pools, cpu);
+        spin_lock_init(&pool->lock);
+        INIT_LIST_HEAD(&pool->pages);
+    }
+
+    if (!pool_high)
+        return true;
+    if (pool_low > pool_high) {
+        printk("Error: pool_low must not be above pool_high.\n");
+        return false;
+    }
+
+    refill_thread = kthread_run(memalloc_pool_thread, NULL, "memalloc_refill");
+    if (IS_ERR(refill_thread)) {
+        printk("Error: Failed to start the pool refill thread.\n");
+        refill_thread = NULL;
+        return false;
+    }
+
+    /* Fill every pool up front, debugfs is best effort */
+    memalloc_pool_kick();
+    pool_debugfs = debugfs_create_dir("memalloc", NULL);
+    debugfs_create_file("pool", 0444, pool_debugfs, NULL, &memalloc_pool_fops);
+
+    printk("Page pools: %u-%u pre-zeroed pages per CPU\n", pool_low, pool_high);
+    return true;
+}
+
+void memalloc_pool_teardown(void) {
+    struct memalloc_pool *pool;
+    struct page *page, *tmp;
+    int cpu;
+
+    debugfs_remove_recursive(pool_debugfs);
+    pool_debugfs = NULL;
+    if (refill_thread) {
+        kthread_stop(refill_thread);
+        refill_thread = NULL;
+    }
+
+    for_each_possible_cpu(cpu) {
+        pool = per_cpu_ptr(&pools, cpu);
+        list_for_each_entry_safe(page, tmp, &pool->pages, lru) {
+            list_del(&page->lru);
+            __free_page(page);
+        }
+        pool->count = 0;
+    }
+}
@@ -0,0 +1,609 @@
+/*
+ * kmod-bench: drive /dev/kmod with a fixed request pattern and report
+ * throughput and latency as one CSV row.
+ *
+ *   kmod-bench -m read|write|zero|discard|copy -s size -n count [-o offset] [options]
+ *
+ * Each thread opens its own /dev/kmod file and issues count requests of
+ * size bytes. Sequential runs give every thread its own region starting at
+ * offset + thread * count * size; random runs pick size-aligned offsets in
+ * [offset, offset + range). Latency is measured per request, except for the
+ * vec interface where one BREADV/BWRITEV call of depth segments counts as a
+ * request. The zero and discard modes issue BWRITEZEROES/BDISCARD over each
+ * request's range instead of moving data, and copy issues BCOPY from each
+ * request's range to the same place range bytes further on.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ioctl-defines-ext.h"
+
+enum bench_iface {
+    IFACE_RW,           /* BREAD/BWRITE on the file cursor */
+    IFACE_OFFSET,       /* BREADOFFSET/BWRITEOFFSET */
+    IFACE_OFFSET64,     /* BREADOFFSET64/BWRITEOFFSET64 */
+    IFACE_VEC,          /* BREADV/BWRITEV, depth segments per call */
+    IFACE_RING,         /* submission/completion ring, depth in flight */
+    IFACE_EVENT,        /* ring fed by BRINGSUBMIT, completions waited for with poll on an eventfd */
+};
+
+static const char *iface_names[] = { "rw", "offset", "offset64", "vec", "ring", "event" };
+
+struct bench_opts {
+    const char      *dev;
+    const char      *label;
+    int             write;
+    unsigned long   range_cmd;  /* BWRITEZEROES, BDISCARD or BCOPY, 0 for data modes */
+    int             random;
+    int             zcopy;
+    enum bench_iface iface;
+    uint64_t        size;
+    uint64_t        count;
+    uint64_t        offset;
+    uint64_t        range;
+    unsigned int    threads;
+    unsigned int    depth;
+    uint64_t        seed;
+    int             header;
+};
+
+struct bench_thread {
+    pthread_t       tid;
+    unsigned int    id;
+    const struct bench_opts *opts;
+    uint64_t        *lat;       /* ns per request */
+    uint64_t        nr_lat;
+    uint64_t        bytes;
+    int             err;
+};
+
+static struct bench_opts opts = {
+    .dev = "/dev/kmod",
+    .label = "-",
+    .iface = IFACE_OFFSET,
+    .threads = 1,
+    .depth = 1,
+    .seed = 1,
+};
+
+static const char *mode_name(const struct bench_opts *o) {
+    if (o->range_cmd == BWRITEZEROES)
+        return "zero";
+    if (o->range_cmd == BDISCARD)
+        return "discard";
+    if (o->range_cmd == BCOPY)
+        return "copy";
+    return o->write ? "write" : "read";
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, seeded per thread so runs are reproducible */
+static uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* Device offset of the i-th request of a thread */
+static uint64_t req_offset(const struct bench_opts *o, unsigned int id, uint64_t i,
+                           uint64_t *rng) {
+    if (o->random)
+        return o->offset + (next_rand(rng) % (o->range / o->size)) * o->size;
+
+    return o->offset + ((uint64_t)id * o->count + i) * o->size;
+}
+
+static void *alloc_buf(size_t size) {
+    void *buf;
+
+    /* Page aligned so the zero-copy paths can pin it */
+    if (posix_memalign(&buf, 4096, size))
+        return NULL;
+    memset(buf, 0xa5, size);
+    return buf;
+}
+
+static long do_ioctl(int fd, unsigned long cmd, void *arg) {
+    long ret = ioctl(fd, cmd, arg);
+
+    return ret < 0 ? -errno : ret;
+}
+
+/* One synchronous request through the rw/offset/offset64 interfaces */
+static long sync_request(const struct bench_opts *o, int fd, char *buf, uint64_t pos) {
+    struct block_rwoffset64_ops op64;
+    struct block_rwoffset_ops op;
+    struct block_range_ops range;
+    struct block_copy_ops copy;
+    struct block_rw_ops rw;
+    long ret;
+
+    if (o->range_cmd == BCOPY) {
+        memset(&copy, 0, sizeof(copy));
+        copy.src = pos;
+        copy.dst = pos + o->range;
+        copy.size = o->size;
+        return do_ioctl(fd, BCOPY, &copy);
+    }
+
+    if (o->range_cmd) {
+        range.offset = pos;
+        range.size = o->size;
+        ret = do_ioctl(fd, o->range_cmd, &range);
+        return ret < 0 ? ret : (long)o->size;
+    }
+
+    switch (o->iface) {
+    case IFACE_RW:
+        rw.data = buf;
+        rw.size = o->size;
+        if (o->write)
+            return do_ioctl(fd, o->zcopy ? BWRITEZC : BWRITE, &rw);
+        return do_ioctl(fd, o->zcopy ? BREADZC : BREAD, &rw);
+
+    case IFACE_OFFSET:
+        op.data = buf;
+        op.size = o->size;
+        op.offset = pos;
+        if (o->write)
+            return do_ioctl(fd, o->zcopy ? BWRITEOFFSETZC : BWRITEOFFSET, &op);
+        return do_ioctl(fd, o->zcopy ? BREADOFFSETZC : BREADOFFSET, &op);
+
+    default:
+        memset(&op64, 0, sizeof(op64));
+        op64.data = (uintptr_t)buf;
+        op64.size = o->size;
+        op64.offset = pos;
+        op64.flags = o->zcopy ? KMOD_RW_ZCOPY : 0;
+        return do_ioctl(fd, o->write ? BWRITEOFFSET64 : BREADOFFSET64, &op64);
+    }
+}
+
+static int run_sync(struct bench_thread *t, int fd) {
+    const struct bench_opts *o = t->opts;
+    uint64_t rng = o->seed + t->id, i;
+    char *buf;
+    long ret;
+
+    buf = alloc_buf(o->size);
+    if (!buf)
+        return -ENOMEM;
+
+    /* The cursor interface can only be sequential: park it at the start */
+    if (o->iface == IFACE_RW) {
+        struct block_rwoffset_ops op = {
+            .data = buf,
+            .size = 0,
+            .offset = req_offset(o, t->id, 0, &rng),
+        };
+
+        ret = do_ioctl(fd, BREADOFFSET, &op);
+        if (ret < 0)
+            goto out;
+    }
+
+    for (i = 0; i < o->count; i++) {
+        uint64_t pos = req_offset(o, t->id, i, &rng);
+        uint64_t start = now_ns();
+
+        ret = sync_request(o, fd, buf, pos);
+        t->lat[t->nr_lat++] = now_ns() - start;
+        if (ret < 0)
+            goto out;
+        if ((uint64_t)ret != o->size) {
+            ret = -EIO;
+            goto out;
+        }
+        t->bytes += ret;
+    }
+    ret = 0;
+
+out:
+    free(buf);
+    return ret;
+}
+
+static int run_vec(struct bench_thread *t, int fd) {
+    const struct bench_opts *o = t->opts;
+    uint64_t rng = o->seed + t->id, i = 0;
+    struct kmod_seg *segs;
+    struct block_vec_ops vec;
+    char *buf;
+    long ret = -ENOMEM;
+    unsigned int n;
+
+    segs = calloc(o->depth, sizeof(*segs));
+    buf = alloc_buf(o->size * o->depth);
+    if (!segs || !buf)
+        goto out;
+
+    while (i < o->count) {
+        uint64_t start;
+
+        for (n = 0; n < o->depth && i < o->count; n++, i++) {
+            segs[n].offset = req_offset(o, t->id, i, &rng);
+            segs[n].data = (uintptr_t)(buf + n * o->size);
+            segs[n].size = o->size;
+            segs[n].result = 0;
+        }
+
+        vec.segs = (uintptr_t)segs;
+        vec.nr_segs = n;
+        vec.flags = o->zcopy ? KMOD_VEC_ZCOPY : 0;
+
+        start = now_ns();
+        ret = do_ioctl(fd, o->write ? BWRITEV : BREADV, &vec);
+        t->lat[t->nr_lat++] = now_ns() - start;
+        if (ret < 0)
+            goto out;
+        if ((uint64_t)ret != n * o->size) {
+            ret = -EIO;
+            goto out;
+        }
+        t->bytes += ret;
+    }
+    ret = 0;
+
+out:
+    free(buf);
+    free(segs);
+    return ret;
+}
+
+static int run_ring(struct bench_thread *t, int fd) {
+    const struct bench_opts *o = t->opts;
+    uint64_t rng = o->seed + t->id;
+    uint64_t submitted = 0, completed = 0;
+    struct kmod_ring_params params = { 0 };
+    struct kmod_ring_enter enter = { 0 };
+    struct kmod_ring_hdr *hdr;
+    struct kmod_sqe *sqes;
+    struct kmod_cqe *cqes;
+    uint64_t *issued = NULL;
+    char *buf = NULL;
+    int efd = -1;
+    void *mem;
+    long ret;
+
+    params.sq_entries = 1;
+    while (params.sq_entries < o->depth)
+        params.sq_entries <<= 1;
+
+    ret = do_ioctl(fd, BRINGSETUP, &params);
+    if (ret < 0)
+        return ret;
+
+    mem = mmap(NULL, params.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+        return -errno;
+    hdr = mem;
+    sqes = (struct kmod_sqe *)((char *)mem + hdr->sq_off);
+    cqes = (struct kmod_cqe *)((char *)mem + hdr->cq_off);
+
+    ret = -ENOMEM;
+    issued = calloc(o->depth, sizeof(*issued));
+    buf = alloc_buf(o->size * o->depth);
+    if (!issued || !buf)
+        goto out;
+
+    if (o->iface == IFACE_EVENT) {
+        efd = eventfd(0, EFD_NONBLOCK);
+        if (efd < 0) {
+            ret = -errno;
+            goto out;
+        }
+        ret = do_ioctl(fd, BRINGEVENTFD, &efd);
+        if (ret < 0)
+            goto out;
+    }
+
+    while (completed < o->count) {
+        unsigned int tail = hdr->sq_tail, head, cq_tail;
+
+        /* Keep depth requests in flight, each with its own buffer slot */
+        while (submitted < o->count && submitted - completed < o->depth) {
+            struct kmod_sqe local, *sqe = &sqes[tail & hdr->sq_mask];
+            unsigned int slot = submitted % o->depth;
+
+            if (o->iface == IFACE_EVENT)
+                sqe = &local;
+
+            sqe->opcode = o->write ? KMOD_OP_WRITE : KMOD_OP_READ;
+            sqe->flags = o->zcopy ? KMOD_SQE_ZCOPY : 0;
+            sqe->user_data = submitted;
+            sqe->op.data = buf + slot * o->size;
+            sqe->op.size = o->size;
+            sqe->op.offset = req_offset(o, t->id, submitted, &rng);
+            issued[slot] = now_ns();
+            if (o->iface == IFACE_EVENT) {
+                ret = do_ioctl(fd, BRINGSUBMIT, sqe);
+                if (ret < 0)
+                    goto out;
+            } else {
+                __atomic_store_n(&hdr->sq_tail, ++tail, __ATOMIC_RELEASE);
+            }
+            submitted++;
+        }
+
+        head = hdr->cq_head;
+        if (o->iface == IFACE_EVENT) {
+            struct pollfd pfd = { .fd = efd, .events = POLLIN };
+            uint64_t events;
+
+            /* Sleep on the eventfd until at least one CQE has been posted */
+            while (head == __atomic_load_n(&hdr->cq_tail, __ATOMIC_ACQUIRE)) {
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                    ret = -errno;
+                    goto out;
+                }
+                if (read(efd, &events, sizeof(events)) < 0 && errno != EAGAIN) {
+                    ret = -errno;
+                    goto out;
+                }
+            }
+        } else {
+            /* Reap whatever is ready, block for one completion if nothing is */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            cq_tail = __atomic_load_n(&hdr->cq_tail, __ATOMIC_ACQUIRE);
+            enter.min_complete = (head == cq_tail);
+            if (enter.min_complete ||
+                (__atomic_load_n(&hdr->flags, __ATOMIC_RELAXED) & KMOD_RING_NEED_WAKEUP)) {
+                ret = do_ioctl(fd, BRINGENTER, &enter);
+                if (ret < 0)
+                    goto out;
+            }
+        }
+
+        cq_tail = __atomic_load_n(&hdr->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++) {
+            struct kmod_cqe *cqe = &cqes[head & hdr->cq_mask];
+
+            t->lat[t->nr_lat++] = now_ns() - issued[cqe->user_data % o->depth];
+            if (cqe->res < 0 || (uint64_t)cqe->res != o->size) {
+                ret = cqe->res < 0 ? cqe->res : -EIO;
+                goto out;
+            }
+            t->bytes += cqe->res;
+            completed++;
+        }
+        __atomic_store_n(&hdr->cq_head, head, __ATOMIC_RELEASE);
+    }
+    ret = 0;
+
+out:
+    if (efd >= 0)
+        close(efd);
+    free(buf);
+    free(issued);
+    munmap(mem, params.ring_size);
+    return ret;
+}
+
+static void *bench_thread(void *arg) {
+    struct bench_thread *t = arg;
+    int fd;
+
+    fd = open(t->opts->dev, O_RDWR);
+    if (fd < 0) {
+        t->err = -errno;
+        return NULL;
+    }
+
+    switch (t->opts->iface) {
+    case IFACE_VEC:
+        t->err = run_vec(t, fd);
+        break;
+    case IFACE_RING:
+    case IFACE_EVENT:
+        t->err = run_ring(t, fd);
+        break;
+    default:
+        t->err = run_sync(t, fd);
+        break;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *lat, uint64_t n, double p) {
+    uint64_t idx;
+
+    if (!n)
+        return 0;
+    idx = (uint64_t)(p * (n - 1) + 0.5);
+    return lat[idx] / 1000.0;
+}
+
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 0);
+
+    switch (*end) {
+    case 'k': case 'K': return v << 10;
+    case 'm': case 'M': return v << 20;
+    case 'g': case 'G': return v << 30;
+    default:            return v;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s -m read|write|zero|discard|copy -s size -n count [options]\n"
+            "  -d dev       device node (default /dev/kmod)\n"
+            "  -o offset    start offset in bytes (default 0)\n"
+            "  -p pattern   seq or rand (default seq)\n"
+            "  -r range     span for random offsets (default threads * count * size)\n"
+            "  -i iface     rw, offset, offset64, vec, ring or event (default offset)\n"
+            "  -z           use the zero-copy variant of the interface\n"
+            "  -j threads   parallel clients, one open file each (default 1)\n"
+            "  -q depth     segments per vec call or requests in flight on the ring\n"
+            "  -S seed      random seed (default 1)\n"
+            "  -L label     value of the label column, e.g. the module parameters\n"
+            "  -H           print the CSV header first\n"
+            "sizes accept k/m/g suffixes\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    struct bench_thread *threads;
+    uint64_t *lat, nr_lat = 0, bytes = 0, start, elapsed;
+    unsigned int i;
+    double secs;
+    int c, err = 0;
+
+    opts.write = -1;
+    while ((c = getopt(argc, argv, "d:m:s:n:o:p:r:i:zj:q:S:L:H")) != -1) {
+        switch (c) {
+        case 'd': opts.dev = optarg; break;
+        case 'm':
+            if (!strcmp(optarg, "read"))
+                opts.write = 0;
+            else if (!strcmp(optarg, "write"))
+                opts.write = 1;
+            else if (!strcmp(optarg, "zero"))
+                opts.write = 1, opts.range_cmd = BWRITEZEROES;
+            else if (!strcmp(optarg, "discard"))
+                opts.write = 1, opts.range_cmd = BDISCARD;
+            else if (!strcmp(optarg, "copy"))
+                opts.write = 1, opts.range_cmd = BCOPY;
+            else
+                usage(argv[0]);
+            break;
+        case 's': opts.size = parse_size(optarg); break;
+        case 'n': opts.count = strtoull(optarg, NULL, 0); break;
+        case 'o': opts.offset = parse_size(optarg); break;
+        case 'p':
+            if (!strcmp(optarg, "seq"))
+                opts.random = 0;
+            else if (!strcmp(optarg, "rand"))
+                opts.random = 1;
+            else
+                usage(argv[0]);
+            break;
+        case 'r': opts.range = parse_size(optarg); break;
+        case 'i':
+            for (i = 0; i < sizeof(iface_names) / sizeof(iface_names[0]); i++)
+                if (!strcmp(optarg, iface_names[i]))
+                    break;
+            if (i == sizeof(iface_names) / sizeof(iface_names[0]))
+                usage(argv[0]);
+            opts.iface = i;
+            break;
+        case 'z': opts.zcopy = 1; break;
+        case 'j': opts.threads = strtoul(optarg, NULL, 0); break;
+        case 'q': opts.depth = strtoul(optarg, NULL, 0); break;
+        case 'S': opts.seed = strtoull(optarg, NULL, 0); break;
+        case 'L': opts.label = optarg; break;
+        case 'H': opts.header = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (opts.write < 0 || !opts.size || !opts.count || !opts.threads || !opts.depth)
+        usage(argv[0]);
+    if (!opts.range)
+        opts.range = opts.threads * opts.count * opts.size;
+    if (opts.range < opts.size) {
+        fprintf(stderr, "range must hold at least one request\n");
+        return 2;
+    }
+    if (opts.range_cmd && opts.iface != IFACE_OFFSET && opts.iface != IFACE_OFFSET64) {
+        fprintf(stderr, "zero, discard and copy take explicit offsets, use -i offset or offset64\n");
+        return 2;
+    }
+    if (opts.iface == IFACE_RW && opts.random) {
+        fprintf(stderr, "the rw interface only supports sequential access\n");
+        return 2;
+    }
+    if (opts.iface == IFACE_VEC && opts.depth > KMOD_VEC_MAX_SEGS) {
+        fprintf(stderr, "vec depth is limited to %d segments\n", KMOD_VEC_MAX_SEGS);
+        return 2;
+    }
+    if ((opts.iface == IFACE_RING || opts.iface == IFACE_EVENT) &&
+        opts.depth > KMOD_RING_MAX_ENTRIES) {
+        fprintf(stderr, "ring depth is limited to %d entries\n", KMOD_RING_MAX_ENTRIES);
+        return 2;
+    }
+
+    threads = calloc(opts.threads, sizeof(*threads));
+    lat = calloc(opts.threads * opts.count, sizeof(*lat));
+    if (!threads || !lat) {
+        perror("calloc");
+        return 1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < opts.threads; i++) {
+        threads[i].id = i;
+        threads[i].opts = &opts;
+        threads[i].lat = lat + i * opts.count;
+        if (pthread_create(&threads[i].tid, NULL, bench_thread, &threads[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (i = 0; i < opts.threads; i++)
+        pthread_join(threads[i].tid, NULL);
+    elapsed = now_ns() - start;
+
+    /* Pack the per-thread samples together before sorting */
+    for (i = 0; i < opts.threads; i++) {
+        memmove(lat + nr_lat, threads[i].lat, threads[i].nr_lat * sizeof(*lat));
+        nr_lat += threads[i].nr_lat;
+        bytes += threads[i].bytes;
+        if (threads[i].err && !err) {
+            err = threads[i].err;
+            fprintf(stderr, "thread %u: %s\n", i, strerror(-err));
+        }
+    }
+    qsort(lat, nr_lat, sizeof(*lat), cmp_u64);
+    secs = elapsed / 1e9;
+
+    if (opts.header)
+        printf("label,mode,iface,zcopy,pattern,size,count,offset,threads,depth,"
+               "bytes,secs,mb_s,iops,p50_us,p99_us,p999_us,status\n");
+    printf("%s,%s,%s,%d,%s,%llu,%llu,%llu,%u,%u,%llu,%.6f,%.2f,%.0f,%.1f,%.1f,%.1f,%s\n",
+           opts.label, mode_name(&opts), iface_names[opts.iface], opts.zcopy,
+           opts.random ? "rand" : "seq",
+           (unsigned long long)opts.size, (unsigned long long)opts.count,
+           (unsigned long long)opts.offset, opts.threads, opts.depth,
+           (unsigned long long)bytes, secs, bytes / secs / 1e6,
+           bytes / opts.size / secs,
+           percentile_us(lat, nr_lat, 0.50), percentile_us(lat, nr_lat, 0.99),
+           percentile_us(lat, nr_lat, 0.999), err ? "error" : "ok");
+
+    free(lat);
+    free(threads);
+    return err ? 1 : 0;
+}
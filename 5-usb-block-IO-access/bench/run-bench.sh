@@ -0,0 +1,200 @@
+#!/bin/bash
+#
+# Load kmod on a scratch loop or null_blk device and run kmod-bench over a
+# sweep of request sizes, counts, offsets, access patterns and interfaces.
+# All rows go to one CSV file so runs from different kmod builds can be
+# compared directly. Needs root; everything on the scratch device is lost.
+# The ram backend loads kmod with engine=ram and no device at all, which
+# leaves only the software overhead of the ioctl path in the numbers.
+#
+#   ./run-bench.sh [-b loop|null_blk|ram] [-g GiB] [-k kmod.ko] [-p "params"]
+#                  [-s screens|sweep|workers|integrity|all] [-c] [-o out.csv]
+#
+# The sweep can be narrowed with environment variables, e.g.
+#   SIZES="4k 64k" IFACES="offset64 ring" THREADS="1 4" ./run-bench.sh -s sweep
+# The workers suite reloads kmod with workers=N for each N in WORKERS, the
+# integrity suite runs the same requests with integrity=0 and integrity=1.
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+BACKEND=loop
+GIB=1
+KMOD="$HERE/../kmodule/kmod.ko"
+PARAMS=""
+SUITE=all
+DROP_CACHES=0
+OUT=""
+
+# Sweep dimensions
+SIZES=${SIZES:-"512 4k 64k 1m"}
+COUNTS=${COUNTS:-"1024"}
+OFFSETS=${OFFSETS:-"0"}
+PATTERNS=${PATTERNS:-"seq rand"}
+MODES=${MODES:-"read write"}
+IFACES=${IFACES:-"offset offset64 vec ring"}
+ZCOPY=${ZCOPY:-"0 1"}
+THREADS=${THREADS:-"1"}
+DEPTH=${DEPTH:-"16"}
+WORKERS=${WORKERS:-"0 1 2 4 8"}
+
+# The runs captured in output_images: mode size count offset
+SCREENS="
+read 512 1 0
+read 512 1024 0
+read 512 10000 131072
+read 2048 100000 0
+read 8192 100 134217728
+read 16384 10000 0
+read 16384 10000 1048576
+write 512 1 0
+write 512 100000 0
+write 2048 10000 16384
+write 8192 10000 0
+write 8192 512 402653184
+write 131072 768 0
+write 393216 1024 402653184
+"
+
+usage() {
+    sed -n '3,17p' "$0" | sed 's/^# \{0,1\}//'
+    exit 2
+}
+
+while getopts "b:g:k:p:s:co:h" opt; do
+    case $opt in
+        b) BACKEND=$OPTARG ;;
+        g) GIB=$OPTARG ;;
+        k) KMOD=$OPTARG ;;
+        p) PARAMS=$OPTARG ;;
+        s) SUITE=$OPTARG ;;
+        c) DROP_CACHES=1 ;;
+        o) OUT=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+[ "$(id -u)" -eq 0 ] || { echo "run-bench.sh must run as root" >&2; exit 1; }
+[ -x "$HERE/kmod-bench" ] || make -C "$HERE" >&2
+[ -f "$KMOD" ] || { echo "$KMOD not found, build the module first" >&2; exit 1; }
+OUT=${OUT:-"kmod-bench-$(date +%Y%m%d-%H%M%S).csv"}
+
+DEV=""
+BACKING=""
+
+cleanup() {
+    rmmod kmod 2>/dev/null || true
+    case $BACKEND in
+        loop)
+            [ -n "$DEV" ] && losetup -d "$DEV"
+            [ -n "$BACKING" ] && rm -f "$BACKING"
+            ;;
+        null_blk)
+            rmmod null_blk 2>/dev/null || true
+            ;;
+    esac
+}
+trap cleanup EXIT
+
+case $BACKEND in
+    loop)
+        BACKING=$(mktemp /var/tmp/kmod-bench.XXXXXX)
+        truncate -s "${GIB}G" "$BACKING"
+        DEV=$(losetup --find --show --direct-io=on "$BACKING")
+        ;;
+    null_blk)
+        # memory_backed keeps written data, so reads after writes are real
+        modprobe null_blk nr_devices=1 gb="$GIB" memory_backed=1 bs=512
+        DEV=/dev/nullb0
+        ;;
+    ram)
+        DEV=none
+        PARAMS="engine=ram ram_mb=$((GIB * 1024)) $PARAMS"
+        ;;
+    *)
+        usage
+        ;;
+esac
+
+# (Re)load kmod on the scratch device with the given extra parameters
+load_kmod() {
+    rmmod kmod 2>/dev/null || true
+    # shellcheck disable=SC2086
+    insmod "$KMOD" device="$DEV" $PARAMS "$@"
+    LABEL=$(echo "$PARAMS $*" | xargs | tr ' ,' '+;')
+    LABEL=${LABEL:-default}
+    echo "kmod loaded on $DEV ($BACKEND, ${GIB} GiB) params: $LABEL" >&2
+}
+
+load_kmod
+
+HEADER=-H
+bench() {
+    if [ "$DROP_CACHES" -eq 1 ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+    echo "kmod-bench $*" >&2
+    "$HERE/kmod-bench" $HEADER -L "$LABEL" "$@" >> "$OUT" || echo "  failed" >&2
+    HEADER=""
+}
+
+: > "$OUT"
+
+if [ "$SUITE" = screens ] || [ "$SUITE" = all ]; then
+    while read -r mode size count offset; do
+        [ -n "$mode" ] || continue
+        bench -m "$mode" -s "$size" -n "$count" -o "$offset" -i offset
+    done <<< "$SCREENS"
+fi
+
+if [ "$SUITE" = sweep ] || [ "$SUITE" = all ]; then
+    for mode in $MODES; do
+    for iface in $IFACES; do
+    for zc in $ZCOPY; do
+    for pattern in $PATTERNS; do
+    for size in $SIZES; do
+    for count in $COUNTS; do
+    for offset in $OFFSETS; do
+    for jobs in $THREADS; do
+        extra=""
+        [ "$zc" -eq 1 ] && extra="-z"
+        case $iface in
+            vec|ring|event) extra="$extra -q $DEPTH" ;;
+            rw) [ "$pattern" = rand ] && continue ;;
+        esac
+        # shellcheck disable=SC2086
+        bench -m "$mode" -i "$iface" -p "$pattern" -s "$size" -n "$count" \
+              -o "$offset" -j "$jobs" $extra
+    done; done; done; done; done; done; done; done
+fi
+
+if [ "$SUITE" = workers ] || [ "$SUITE" = all ]; then
+    # Large copy-path requests are split over the workers, vec segments
+    # are spread over them one per queue
+    for n in $WORKERS; do
+        load_kmod workers="$n"
+        for mode in $MODES; do
+            bench -m "$mode" -i offset64 -s 16m -n 32
+            bench -m "$mode" -i vec -q "$DEPTH" -s 64k -n 4096
+            bench -m "$mode" -i vec -q "$DEPTH" -p rand -s 4k -n 16384
+        done
+    done
+fi
+
+if [ "$SUITE" = integrity ] || [ "$SUITE" = all ]; then
+    # Same requests with and without CRC32C checksums: the difference in
+    # the two rows of each pair is the cost of integrity mode
+    for v in 0 1; do
+        load_kmod integrity="$v"
+        for mode in write read; do
+            for size in 4k 64k 1m; do
+                bench -m "$mode" -i offset64 -s "$size" -n 2048
+                bench -m "$mode" -i offset64 -p rand -s "$size" -n 2048
+            done
+            bench -m "$mode" -i offset64 -s 1k -n 4096
+        done
+    done
+fi
+
+echo "results in $OUT" >&2
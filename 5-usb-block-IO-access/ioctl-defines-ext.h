@@ -0,0 +1,192 @@
+#ifndef __IOCTL_DEFINES_EXT_H__
+#define __IOCTL_DEFINES_EXT_H__
+
+/*
+ * Extended kmod operations. These sit next to the base BREAD/BWRITE/
+ * BREADOFFSET/BWRITEOFFSET commands from ioctl-defines.h and use their own
+ * ioctl magic so old binaries keep working unchanged.
+ *
+ * When kmod is loaded with integrity=1, any read fails with EBADMSG if a
+ * block's CRC32C no longer matches what was written.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#include "ioctl-defines.h"
+
+#define KMOD_EXT_MAGIC      'k'
+
+/* Zero-copy variants: the user buffer is pinned and used for the bio directly */
+#define BREADZC             _IOR(KMOD_EXT_MAGIC, 1, struct block_rw_ops)
+#define BWRITEZC            _IOW(KMOD_EXT_MAGIC, 2, struct block_rw_ops)
+#define BREADOFFSETZC       _IOR(KMOD_EXT_MAGIC, 3, struct block_rwoffset_ops)
+#define BWRITEOFFSETZC      _IOW(KMOD_EXT_MAGIC, 4, struct block_rwoffset_ops)
+
+/*
+ * Asynchronous submission/completion rings. BRINGSETUP sizes the rings and
+ * returns the length to mmap() from /dev/kmod at offset 0. The mapping
+ * starts with a struct kmod_ring_hdr, followed by the SQE array at sq_off
+ * and the CQE array at cq_off.
+ *
+ * Userspace fills SQEs and publishes them by advancing sq_tail, a kernel
+ * worker consumes them and posts CQEs at cq_tail. BRINGENTER is only needed
+ * to wake the worker once it has set KMOD_RING_NEED_WAKEUP, or to block
+ * until min_complete completions are available. A worker stopped by a full
+ * CQ also sleeps until BRINGENTER or poll() shows it cq_head has moved.
+ */
+#define KMOD_RING_MAX_ENTRIES   4096
+#define KMOD_RING_NEED_WAKEUP   (1U << 0)
+
+#define KMOD_OP_READ            0
+#define KMOD_OP_WRITE           1
+
+#define KMOD_SQE_ZCOPY          (1U << 0)
+
+struct kmod_ring_params {
+    __u32 sq_entries;       /* in: power of two, <= KMOD_RING_MAX_ENTRIES */
+    __u32 cq_entries;       /* out: twice sq_entries */
+    __u32 ring_size;        /* out: bytes to mmap */
+    __u32 resv;
+};
+
+struct kmod_ring_hdr {
+    __u32 sq_head;          /* written by the kernel */
+    __u32 sq_tail;          /* written by userspace */
+    __u32 cq_head;          /* written by userspace */
+    __u32 cq_tail;          /* written by the kernel */
+    __u32 sq_mask;
+    __u32 cq_mask;
+    __u32 sq_off;
+    __u32 cq_off;
+    __u32 flags;            /* KMOD_RING_NEED_WAKEUP */
+    __u32 resv;
+};
+
+struct kmod_sqe {
+    __u32 opcode;           /* KMOD_OP_READ / KMOD_OP_WRITE */
+    __u32 flags;            /* KMOD_SQE_ZCOPY */
+    __u64 user_data;
+    struct block_rwoffset_ops op;
+};
+
+struct kmod_cqe {
+    __u64 user_data;
+    __s64 res;              /* bytes transferred or -errno */
+};
+
+struct kmod_ring_enter {
+    __u32 min_complete;
+    __u32 resv;
+};
+
+#define BRINGSETUP          _IOWR(KMOD_EXT_MAGIC, 5, struct kmod_ring_params)
+#define BRINGENTER          _IOW(KMOD_EXT_MAGIC, 6, struct kmod_ring_enter)
+
+/*
+ * Completion notification without blocking in BRINGENTER. Once the ring is
+ * set up, poll()/epoll on /dev/kmod reports POLLIN while CQEs are waiting
+ * and POLLOUT while the SQ has room, and the eventfd passed to BRINGEVENTFD
+ * (-1 to drop it) is signaled once per CQE. BRINGSUBMIT copies one SQE into
+ * the SQ and returns at once, EAGAIN when it is full; don't mix it with
+ * filling the mmapped SQ directly.
+ */
+#define BRINGSUBMIT         _IOW(KMOD_EXT_MAGIC, 16, struct kmod_sqe)
+#define BRINGEVENTFD        _IOW(KMOD_EXT_MAGIC, 17, __s32)
+
+/*
+ * Vectored operations: one ioctl carries an array of segments. Zero-copy
+ * segments are submitted together under one block plug and, with workers=N,
+ * copy-path segments run in parallel on the worker threads; any other
+ * copy-path segment runs synchronously after those are issued. Each
+ * segment's result field is filled with the bytes transferred or a
+ * negative errno.
+ */
+#define KMOD_VEC_MAX_SEGS       1024
+
+#define KMOD_VEC_ZCOPY          (1U << 0)
+
+struct kmod_seg {
+    __u64 offset;
+    __u64 data;             /* user buffer */
+    __u32 size;
+    __s32 result;           /* out */
+};
+
+struct block_vec_ops {
+    __u64 segs;             /* user pointer to struct kmod_seg[nr_segs] */
+    __u32 nr_segs;
+    __u32 flags;            /* KMOD_VEC_ZCOPY */
+};
+
+#define BREADV              _IOWR(KMOD_EXT_MAGIC, 7, struct block_vec_ops)
+#define BWRITEV             _IOWR(KMOD_EXT_MAGIC, 8, struct block_vec_ops)
+
+/* Block cache counters, see cache_size_mb/readahead_* module parameters */
+struct kmod_cache_stats {
+    __u64 hits;
+    __u64 misses;
+    __u64 ra_issued;        /* blocks prefetched */
+    __u64 ra_hits;          /* prefetched blocks later read */
+    __u64 evictions;
+    __u32 nr_blocks;
+    __u32 max_blocks;
+    __u32 block_size;
+    __u32 resv;
+};
+
+#define BCACHESTATS         _IOR(KMOD_EXT_MAGIC, 9, struct kmod_cache_stats)
+
+/* Write out coalesced writes (see wbuf_kb) and flush the device cache */
+#define BFLUSH              _IO(KMOD_EXT_MAGIC, 10)
+
+/*
+ * Offset operations with 64-bit offsets and lengths. The range is checked
+ * against the device size; KMOD_RW_ZCOPY selects the zero-copy path.
+ */
+#define KMOD_RW_ZCOPY           (1U << 0)
+
+struct block_rwoffset64_ops {
+    __u64 data;             /* user buffer */
+    __u64 offset;
+    __u64 size;
+    __u32 flags;            /* KMOD_RW_ZCOPY */
+    __u32 resv;
+};
+
+#define BREADOFFSET64       _IOR(KMOD_EXT_MAGIC, 11, struct block_rwoffset64_ops)
+#define BWRITEOFFSET64      _IOW(KMOD_EXT_MAGIC, 12, struct block_rwoffset64_ops)
+
+/*
+ * Range operations: no data is passed. Offset and size must be multiples of
+ * the device's logical block size. BDISCARD fails with EOPNOTSUPP when the
+ * device cannot discard; BWRITEZEROES always succeeds on a working device,
+ * the kernel writes the zeroes itself when there is no offload.
+ */
+struct block_range_ops {
+    __u64 offset;
+    __u64 size;
+};
+
+#define BDISCARD            _IOW(KMOD_EXT_MAGIC, 13, struct block_range_ops)
+#define BWRITEZEROES        _IOW(KMOD_EXT_MAGIC, 14, struct block_range_ops)
+
+/*
+ * Copy size bytes from src to dst on the device without passing through
+ * userspace; the ranges may overlap. Returns the bytes copied, which is
+ * short (or EINTR) when the caller is killed part way. Copy offload is used
+ * where the backing store has it unless KMOD_COPY_NO_OFFLOAD is set.
+ */
+#define KMOD_COPY_NO_OFFLOAD    (1U << 0)
+
+struct block_copy_ops {
+    __u64 src;
+    __u64 dst;
+    __u64 size;
+    __u32 flags;            /* KMOD_COPY_NO_OFFLOAD */
+    __u32 resv;
+};
+
+#define BCOPY               _IOW(KMOD_EXT_MAGIC, 15, struct block_copy_ops)
+
+#endif
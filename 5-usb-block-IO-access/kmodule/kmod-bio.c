@@ -0,0 +1,149 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "kmod-common.h"
+
+/*
+ * Direct bio engine: used when the module is loaded with engine=bio. The
+ * device is opened with bdev_file_open_by_path() and every kernel buffer is
+ * turned into bios directly, so nothing goes through the block device page
+ * cache. Requests that aren't aligned to the logical block size are bounced
+ * through a block-aligned buffer (read-modify-write for writes).
+ *
+ * A read-modify-write has to be atomic against every other write to the
+ * blocks it covers, or bytes written in between are lost. Unaligned writes
+ * take bio_rmw_sem exclusively; aligned writes, discard and write-zeroes
+ * take it shared, so they still run in parallel with each other and only
+ * wait for an RMW in flight. Zero-copy bios stay in flight across other
+ * requests and are not covered: holding the lock that long could deadlock
+ * against an unaligned segment of the same BWRITEV.
+ */
+
+static DECLARE_RWSEM(bio_rmw_sem);
+
+/* Held around synchronous writes that bypass kmod_bio_rw() */
+void kmod_bio_write_begin(void) {
+    down_read(&bio_rmw_sem);
+}
+
+void kmod_bio_write_end(void) {
+    up_read(&bio_rmw_sem);
+}
+
+static struct page *kmod_bio_buf_page(const void *buf) {
+    if (is_vmalloc_addr(buf))
+        return vmalloc_to_page(buf);
+    return virt_to_page(buf);
+}
+
+/* Map a kernel buffer onto a chain of bios and wait for all of them */
+static int kmod_bio_submit(struct block_device *bdev, void *buf, size_t size,
+                           loff_t pos, blk_opf_t opf) {
+    unsigned int nr_pages = DIV_ROUND_UP(offset_in_page(buf) + size, PAGE_SIZE);
+    sector_t sector = pos >> SECTOR_SHIFT;
+    struct bio *bio = NULL;
+    int ret;
+
+    if (is_vmalloc_addr(buf) && op_is_write(opf))
+        flush_kernel_vmap_range(buf, size);
+
+    while (size) {
+        unsigned int off = offset_in_page(buf);
+        unsigned int len = min_t(size_t, PAGE_SIZE - off, size);
+        struct page *page = kmod_bio_buf_page(buf);
+
+        if (!bio || bio_add_page(bio, page, len, off) != len) {
+            /* Chains the previous bio to the new one and submits it */
+            bio = blk_next_bio(bio, bdev, min_t(unsigned int, nr_pages, BIO_MAX_VECS),
+                               opf, GFP_KERNEL);
+            bio->bi_iter.bi_sector = sector;
+            __bio_add_page(bio, page, len, off);
+        }
+
+        buf += len;
+        size -= len;
+        sector += len >> SECTOR_SHIFT;
+        nr_pages--;
+    }
+
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+    return ret;
+}
+
+ssize_t kmod_bio_rw(struct file *file, void *buf, size_t size, loff_t *pos, bool write) {
+    struct block_device *bdev = file_bdev(file);
+    unsigned int lbs = bdev_logical_block_size(bdev);
+    blk_opf_t opf = write ? REQ_OP_WRITE | REQ_SYNC : REQ_OP_READ;
+    loff_t dev_size = bdev_nr_bytes(bdev);
+    loff_t start, end;
+    char *bounce;
+    int ret;
+
+    /* Match kernel_read()/kernel_write() semantics at the end of the device */
+    if (*pos >= dev_size)
+        return write ? -ENOSPC : 0;
+    if (*pos + size > dev_size) {
+        if (write)
+            return -ENOSPC;
+        size = dev_size - *pos;
+    }
+    if (!size)
+        return 0;
+
+    if (!((*pos | size | (unsigned long)buf) & ((lbs - 1) | bdev_dma_alignment(bdev)))) {
+        if (write)
+            kmod_bio_write_begin();
+        ret = kmod_bio_submit(bdev, buf, size, *pos, opf);
+        if (write)
+            kmod_bio_write_end();
+        if (is_vmalloc_addr(buf) && !write)
+            invalidate_kernel_vmap_range(buf, size);
+        if (ret)
+            return ret;
+
+        *pos += size;
+        return size;
+    }
+
+    /*
+     * Unaligned fallback: cover the request with whole blocks. Writes read
+     * the covering blocks first so the bytes around the request survive.
+     */
+    start = round_down(*pos, lbs);
+    end = round_up(*pos + size, lbs);
+    bounce = kmod_pool_alloc(end - start);
+    if (!bounce)
+        return -ENOMEM;
+
+    if (write)
+        down_write(&bio_rmw_sem);
+    ret = kmod_bio_submit(bdev, bounce, end - start, start, REQ_OP_READ);
+    if (ret)
+        goto out;
+
+    if (write) {
+        memcpy(bounce + (*pos - start), buf, size);
+        ret = kmod_bio_submit(bdev, bounce, end - start, start, opf);
+        if (ret)
+            goto out;
+    } else {
+        if (is_vmalloc_addr(bounce))
+            invalidate_kernel_vmap_range(bounce, end - start);
+        memcpy(buf, bounce + (*pos - start), size);
+    }
+
+    *pos += size;
+    ret = size;
+out:
+    if (write)
+        up_write(&bio_rmw_sem);
+    kmod_pool_free(bounce, end - start);
+    return ret;
+}
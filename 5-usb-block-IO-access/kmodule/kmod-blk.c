@@ -0,0 +1,355 @@
+#include <linux/blk-mq.h>
+#include <linux/blkdev.h>
+#include <linux/bvec.h>
+#include <linux/fs.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/sched/mm.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+#include "kmod-common.h"
+
+/*
+ * blk-mq block device /dev/kmodblk0 stacked on the device kmod opened, so
+ * filesystems, dd and fio can use the module. Requests are queued on a
+ * workqueue and forwarded through the same kmod_dev_read()/kmod_dev_write()
+ * layer as the ioctls, so the selected engine, the write buffer and block
+ * cache invalidation all apply. Each request is staged in one pool buffer
+ * and issued to the device as a single transfer; requests are capped at
+ * blk_max_kb so the block layer merges and splits bios to fit. Discards
+ * and write-zeroes are passed down as range operations without staging.
+ */
+
+/* Hardware queues, 0 disables the block device */
+static unsigned int blk_queues = 1;
+module_param(blk_queues, uint, S_IRUGO);
+
+/* Tags per hardware queue */
+static unsigned int blk_depth = 64;
+module_param(blk_depth, uint, S_IRUGO);
+
+/* Largest request in KiB */
+static unsigned int blk_max_kb = 1024;
+module_param(blk_max_kb, uint, S_IRUGO);
+
+struct kmod_blk_cmd {
+    struct work_struct  work;
+};
+
+struct kmod_blk_stats {
+    u64 reads;
+    u64 writes;
+    u64 flushes;
+    u64 discards;
+    u64 zeroes;
+    u64 errors;
+    u64 read_bytes;
+    u64 write_bytes;
+    u64 bios;
+    u64 merged;         /* bios merged into a request behind its first one */
+    u64 split;          /* chained bios (BIO_CHAIN), only approximates splits */
+};
+
+static int blk_major;
+static struct blk_mq_tag_set blk_tag_set;
+static struct gendisk *blk_disk;
+static struct workqueue_struct *blk_wq;
+static struct kmod_blk_stats __percpu *blk_stats;
+
+/* Write buffer errors already reported through a flush request */
+static errseq_t blk_wbuf_since;
+
+static blk_status_t kmod_blk_flush(void) {
+    int err = kmod_wbuf_flush(&blk_wbuf_since);
+
+    if (!err)
+        err = kmod_dev_sync();
+    return errno_to_blk_status(err);
+}
+
+static blk_status_t kmod_blk_discard(struct request *rq) {
+    loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    int err;
+
+    if (req_op(rq) == REQ_OP_WRITE_ZEROES)
+        err = kmod_dev_write_zeroes(pos, blk_rq_bytes(rq));
+    else
+        err = kmod_dev_discard(pos, blk_rq_bytes(rq));
+    return errno_to_blk_status(err);
+}
+
+static blk_status_t kmod_blk_rw(struct request *rq) {
+    loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    size_t size = blk_rq_bytes(rq), off = 0;
+    bool write = rq_data_dir(rq) == WRITE;
+    struct req_iterator iter;
+    struct bio_vec bv;
+    ssize_t bytes;
+    char *buf;
+
+    buf = kmod_pool_alloc(size);
+    if (!buf)
+        return BLK_STS_RESOURCE;
+
+    if (write) {
+        rq_for_each_segment(bv, rq, iter) {
+            memcpy_from_bvec(buf + off, &bv);
+            off += bv.bv_len;
+        }
+        bytes = kmod_dev_write(buf, size, &pos);
+    } else {
+        bytes = kmod_dev_read(buf, size, &pos);
+        if (bytes == (ssize_t)size) {
+            rq_for_each_segment(bv, rq, iter) {
+                memcpy_to_bvec(&bv, buf + off);
+                off += bv.bv_len;
+            }
+        }
+    }
+
+    kmod_pool_free(buf, size);
+
+    if (bytes < 0)
+        return errno_to_blk_status(bytes);
+    return bytes == (ssize_t)size ? BLK_STS_OK : BLK_STS_IOERR;
+}
+
+static void kmod_blk_account(struct request *rq, blk_status_t status) {
+    unsigned int nr = 0;
+    struct bio *bio;
+
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+        this_cpu_inc(blk_stats->reads);
+        this_cpu_add(blk_stats->read_bytes, blk_rq_bytes(rq));
+        break;
+    case REQ_OP_WRITE:
+        this_cpu_inc(blk_stats->writes);
+        this_cpu_add(blk_stats->write_bytes, blk_rq_bytes(rq));
+        break;
+    case REQ_OP_FLUSH:
+        this_cpu_inc(blk_stats->flushes);
+        break;
+    case REQ_OP_DISCARD:
+        this_cpu_inc(blk_stats->discards);
+        break;
+    case REQ_OP_WRITE_ZEROES:
+        this_cpu_inc(blk_stats->zeroes);
+        break;
+    default:
+        break;
+    }
+
+    /*
+     * A split leaves BIO_CHAIN on the remainder, so each split bio is
+     * counted once however many pieces it was cut into. Bios chained for
+     * other reasons, by a filesystem for instance, carry the same flag, and
+     * the block layer keeps no record of the original range to tell them
+     * apart, so this is only an estimate.
+     */
+    __rq_for_each_bio(bio, rq) {
+        nr++;
+        if (bio_flagged(bio, BIO_CHAIN))
+            this_cpu_inc(blk_stats->split);
+    }
+    if (nr) {
+        this_cpu_add(blk_stats->bios, nr);
+        this_cpu_add(blk_stats->merged, nr - 1);
+    }
+
+    if (status != BLK_STS_OK)
+        this_cpu_inc(blk_stats->errors);
+}
+
+static void kmod_blk_work(struct work_struct *work) {
+    struct kmod_blk_cmd *cmd = container_of(work, struct kmod_blk_cmd, work);
+    struct request *rq = blk_mq_rq_from_pdu(cmd);
+    unsigned int noio;
+    blk_status_t status;
+
+    /* Allocations here must not recurse into I/O on this device */
+    noio = memalloc_noio_save();
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        status = kmod_blk_rw(rq);
+        break;
+    case REQ_OP_FLUSH:
+        status = kmod_blk_flush();
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        status = kmod_blk_discard(rq);
+        break;
+    default:
+        status = BLK_STS_NOTSUPP;
+        break;
+    }
+    memalloc_noio_restore(noio);
+
+    kmod_blk_account(rq, status);
+    blk_mq_end_request(rq, status);
+}
+
+static blk_status_t kmod_blk_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                      const struct blk_mq_queue_data *bd) {
+    struct kmod_blk_cmd *cmd = blk_mq_rq_to_pdu(bd->rq);
+
+    blk_mq_start_request(bd->rq);
+    queue_work(blk_wq, &cmd->work);
+    return BLK_STS_OK;
+}
+
+static int kmod_blk_init_request(struct blk_mq_tag_set *set, struct request *rq,
+                                 unsigned int hctx_idx, unsigned int numa_node) {
+    struct kmod_blk_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+    INIT_WORK(&cmd->work, kmod_blk_work);
+    return 0;
+}
+
+static const struct blk_mq_ops kmod_blk_mq_ops = {
+    .queue_rq       = kmod_blk_queue_rq,
+    .init_request   = kmod_blk_init_request,
+};
+
+static const struct block_device_operations kmod_blk_fops = {
+    .owner          = THIS_MODULE,
+};
+
+void kmod_blk_show(struct seq_file *m) {
+    struct kmod_blk_stats sum = { 0 };
+    int cpu;
+
+    if (!blk_stats) {
+        seq_puts(m, "block device disabled\n");
+        return;
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct kmod_blk_stats *st = per_cpu_ptr(blk_stats, cpu);
+
+        sum.reads += st->reads;
+        sum.writes += st->writes;
+        sum.flushes += st->flushes;
+        sum.discards += st->discards;
+        sum.zeroes += st->zeroes;
+        sum.errors += st->errors;
+        sum.read_bytes += st->read_bytes;
+        sum.write_bytes += st->write_bytes;
+        sum.bios += st->bios;
+        sum.merged += st->merged;
+        sum.split += st->split;
+    }
+
+    seq_printf(m, "reads %llu\nwrites %llu\nflushes %llu\ndiscards %llu\nwrite_zeroes %llu\n",
+               sum.reads, sum.writes, sum.flushes, sum.discards, sum.zeroes);
+    seq_printf(m, "errors %llu\n", sum.errors);
+    seq_printf(m, "read_bytes %llu\nwrite_bytes %llu\n", sum.read_bytes, sum.write_bytes);
+    seq_printf(m, "bios %llu\nmerged %llu\nsplit_approx %llu\n", sum.bios, sum.merged, sum.split);
+}
+
+void kmod_blk_teardown(void) {
+    if (blk_disk) {
+        del_gendisk(blk_disk);
+        put_disk(blk_disk);
+        blk_disk = NULL;
+    }
+    if (blk_tag_set.tags) {
+        blk_mq_free_tag_set(&blk_tag_set);
+        memset(&blk_tag_set, 0, sizeof(blk_tag_set));
+    }
+    if (blk_wq) {
+        destroy_workqueue(blk_wq);
+        blk_wq = NULL;
+    }
+    if (blk_major > 0) {
+        unregister_blkdev(blk_major, "kmodblk");
+        blk_major = 0;
+    }
+    free_percpu(blk_stats);
+    blk_stats = NULL;
+}
+
+bool kmod_blk_init(void) {
+    struct queue_limits lim = {
+        /* Never advertise a smaller block than the devices underneath can take */
+        .logical_block_size = kmod_dev_block_size(),
+        .max_hw_sectors     = max_t(unsigned int, blk_max_kb, PAGE_SIZE >> 10) << 1,
+        /* Discards and write-zeroes carry no data, so they can be much larger */
+        .max_hw_discard_sectors     = UINT_MAX >> SECTOR_SHIFT,
+        .max_write_zeroes_sectors   = UINT_MAX >> SECTOR_SHIFT,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0)
+        /* Flushes push out the write buffer and the device cache */
+        .features                   = BLK_FEAT_WRITE_CACHE,
+#endif
+    };
+    int err;
+
+    if (!blk_queues)
+        return true;
+
+    blk_stats = alloc_percpu(struct kmod_blk_stats);
+    if (!blk_stats)
+        return false;
+    blk_wbuf_since = kmod_wbuf_sample();
+
+    blk_major = register_blkdev(0, "kmodblk");
+    if (blk_major < 0)
+        goto fail;
+
+    blk_wq = alloc_workqueue("kmod-blk", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+    if (!blk_wq)
+        goto fail;
+
+    blk_tag_set.ops = &kmod_blk_mq_ops;
+    blk_tag_set.nr_hw_queues = blk_queues;
+    blk_tag_set.queue_depth = blk_depth;
+    blk_tag_set.numa_node = NUMA_NO_NODE;
+    blk_tag_set.cmd_size = sizeof(struct kmod_blk_cmd);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,14,0)
+    blk_tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+#endif
+    err = blk_mq_alloc_tag_set(&blk_tag_set);
+    if (err) {
+        blk_tag_set.tags = NULL;
+        goto fail;
+    }
+
+    blk_disk = blk_mq_alloc_disk(&blk_tag_set, &lim, NULL);
+    if (IS_ERR(blk_disk)) {
+        blk_disk = NULL;
+        goto fail;
+    }
+
+    blk_disk->major = blk_major;
+    blk_disk->first_minor = 0;
+    blk_disk->minors = 1;
+    blk_disk->fops = &kmod_blk_fops;
+    snprintf(blk_disk->disk_name, DISK_NAME_LEN, "kmodblk0");
+    set_capacity(blk_disk, kmod_dev_size() >> SECTOR_SHIFT);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,11,0)
+    /* Flushes push out the write buffer and the device cache */
+    blk_queue_write_cache(blk_disk->queue, true, false);
+#endif
+
+    err = add_disk(blk_disk);
+    if (err) {
+        put_disk(blk_disk);
+        blk_disk = NULL;
+        goto fail;
+    }
+
+    printk(KERN_INFO "Block device %s: %u queues of depth %u, %llu sectors\n",
+           blk_disk->disk_name, blk_queues, blk_depth, get_capacity(blk_disk));
+    return true;
+
+fail:
+    printk(KERN_ERR "Failed to register kmodblk0\n");
+    kmod_blk_teardown();
+    return false;
+}
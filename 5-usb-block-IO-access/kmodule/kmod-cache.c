@@ -0,0 +1,420 @@
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/hashtable.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/overflow.h>
+#include <linux/refcount.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "../ioctl-defines-ext.h"
+#include "kmod-common.h"
+
+/*
+ * Block cache for sequential BREAD streams. The device is cached in fixed
+ * 64 KiB blocks kept on an LRU list and bounded by cache_size_mb. Each open
+ * file tracks its own stream: once readahead_trigger reads in a row continue
+ * where the previous one stopped, the next readahead_blocks blocks are
+ * loaded asynchronously on a workqueue. Every write path invalidates the
+ * blocks it touches, so cached data never outlives a write.
+ */
+
+#define KMOD_CACHE_BLOCK_SHIFT  16
+#define KMOD_CACHE_BLOCK_SIZE   (1UL << KMOD_CACHE_BLOCK_SHIFT)
+#define KMOD_CACHE_HASH_BITS    10
+
+/* Cache size in MiB, 0 disables the cache */
+static unsigned int cache_size_mb = 0;
+module_param(cache_size_mb, uint, S_IRUGO);
+
+/* Blocks to prefetch ahead of a sequential stream */
+static unsigned int readahead_blocks = 8;
+module_param(readahead_blocks, uint, S_IRUGO | S_IWUSR);
+
+/* Sequential reads needed before readahead kicks in */
+static unsigned int readahead_trigger = 2;
+module_param(readahead_trigger, uint, S_IRUGO | S_IWUSR);
+
+/* Block state bits */
+#define KMOD_CB_UPTODATE        0
+#define KMOD_CB_READAHEAD       1
+
+struct kmod_cache_block {
+    u64                 index;
+    struct hlist_node   hash;
+    struct list_head    lru;
+    refcount_t          ref;
+    unsigned long       flags;
+    int                 error;
+    size_t              len;        /* valid bytes, short at the end of the device */
+    char                *data;
+    struct completion   ready;
+};
+
+struct kmod_ra_work {
+    struct work_struct          work;
+    unsigned int                nr;
+    struct kmod_cache_block     *blocks[];
+};
+
+static DEFINE_HASHTABLE(cache_hash, KMOD_CACHE_HASH_BITS);
+static LIST_HEAD(cache_lru);
+static DEFINE_SPINLOCK(cache_lock);
+static unsigned int cache_nr_blocks;
+static unsigned int cache_max_blocks;
+static struct workqueue_struct *cache_wq;
+
+/* Counters reported through BCACHESTATS */
+static atomic64_t cache_hits;
+static atomic64_t cache_misses;
+static atomic64_t cache_ra_issued;
+static atomic64_t cache_ra_hits;
+static atomic64_t cache_evictions;
+
+static void kmod_cache_put(struct kmod_cache_block *cb) {
+    if (refcount_dec_and_test(&cb->ref)) {
+        kmod_pool_free(cb->data, KMOD_CACHE_BLOCK_SIZE);
+        kfree(cb);
+    }
+}
+
+/* Drop the cache references of blocks collected under cache_lock */
+static void kmod_cache_dispose(struct list_head *dispose) {
+    struct kmod_cache_block *cb, *tmp;
+
+    list_for_each_entry_safe(cb, tmp, dispose, lru) {
+        list_del(&cb->lru);
+        kmod_cache_put(cb);
+    }
+}
+
+/* Called with cache_lock held */
+static struct kmod_cache_block *kmod_cache_find(u64 index) {
+    struct kmod_cache_block *cb;
+
+    hash_for_each_possible(cache_hash, cb, hash, index)
+        if (cb->index == index)
+            return cb;
+    return NULL;
+}
+
+/* Called with cache_lock held, the cache's reference moves to dispose */
+static void kmod_cache_unhash(struct kmod_cache_block *cb, struct list_head *dispose) {
+    hash_del(&cb->hash);
+    list_move(&cb->lru, dispose);
+    cache_nr_blocks--;
+}
+
+/* Make room for one more block, called with cache_lock held */
+static void kmod_cache_evict(struct list_head *dispose) {
+    struct kmod_cache_block *cb, *tmp;
+
+    list_for_each_entry_safe_reverse(cb, tmp, &cache_lru, lru) {
+        if (cache_nr_blocks < cache_max_blocks)
+            break;
+
+        /* Blocks still being loaded have someone waiting on them */
+        if (!completion_done(&cb->ready))
+            continue;
+
+        kmod_cache_unhash(cb, dispose);
+        atomic64_inc(&cache_evictions);
+    }
+}
+
+static struct kmod_cache_block *kmod_cache_alloc(u64 index) {
+    struct kmod_cache_block *cb;
+
+    cb = kzalloc(sizeof(*cb), GFP_KERNEL);
+    if (!cb)
+        return NULL;
+
+    cb->data = kmod_pool_alloc(KMOD_CACHE_BLOCK_SIZE);
+    if (!cb->data) {
+        kfree(cb);
+        return NULL;
+    }
+
+    cb->index = index;
+    refcount_set(&cb->ref, 1);
+    init_completion(&cb->ready);
+    return cb;
+}
+
+/*
+ * Look up a block, inserting an empty one on a miss. Returns with a
+ * reference held; *created tells the caller it has to load the block.
+ */
+static struct kmod_cache_block *kmod_cache_get(u64 index, bool *created) {
+    struct kmod_cache_block *cb, *new = NULL;
+    LIST_HEAD(dispose);
+
+again:
+    spin_lock(&cache_lock);
+    cb = kmod_cache_find(index);
+    if (cb) {
+        refcount_inc(&cb->ref);
+        list_move(&cb->lru, &cache_lru);
+        spin_unlock(&cache_lock);
+
+        if (new)
+            kmod_cache_put(new);
+        *created = false;
+        return cb;
+    }
+
+    if (!new) {
+        spin_unlock(&cache_lock);
+        new = kmod_cache_alloc(index);
+        if (!new)
+            return NULL;
+        goto again;
+    }
+
+    kmod_cache_evict(&dispose);
+    hash_add(cache_hash, &new->hash, index);
+    list_add(&new->lru, &cache_lru);
+    cache_nr_blocks++;
+    refcount_inc(&new->ref);
+    spin_unlock(&cache_lock);
+
+    kmod_cache_dispose(&dispose);
+    *created = true;
+    return new;
+}
+
+/* Remove a block whose load failed so the next reader retries it */
+static void kmod_cache_drop(struct kmod_cache_block *cb) {
+    LIST_HEAD(dispose);
+
+    spin_lock(&cache_lock);
+    if (hash_hashed(&cb->hash))
+        kmod_cache_unhash(cb, &dispose);
+    spin_unlock(&cache_lock);
+
+    kmod_cache_dispose(&dispose);
+}
+
+static void kmod_cache_load(struct kmod_cache_block *cb) {
+    loff_t pos = cb->index << KMOD_CACHE_BLOCK_SHIFT;
+    ssize_t bytes;
+
+    bytes = kmod_dev_read(cb->data, KMOD_CACHE_BLOCK_SIZE, &pos);
+    if (bytes < 0) {
+        cb->error = bytes;
+    } else {
+        cb->len = bytes;
+        set_bit(KMOD_CB_UPTODATE, &cb->flags);
+    }
+    complete_all(&cb->ready);
+
+    if (cb->error)
+        kmod_cache_drop(cb);
+}
+
+static void kmod_cache_ra_work(struct work_struct *work) {
+    struct kmod_ra_work *ra = container_of(work, struct kmod_ra_work, work);
+    unsigned int i;
+
+    for (i = 0; i < ra->nr; i++) {
+        kmod_cache_load(ra->blocks[i]);
+        kmod_cache_put(ra->blocks[i]);
+    }
+    kfree(ra);
+}
+
+/*
+ * Feed one whole request to the stream detector and prefetch ahead of it
+ * when it continues a sequential stream. Called once per user request, not
+ * per chunk, so a large read counts as one step of the stream.
+ */
+void kmod_cache_stream(struct kmod_stream *stream, loff_t pos, size_t size) {
+    unsigned int depth = min(readahead_blocks, cache_max_blocks / 2);
+    struct kmod_ra_work *ra;
+    u64 first, last, index;
+    bool created;
+
+    if (!size)
+        return;
+
+    if (pos == stream->next) {
+        stream->seq++;
+    } else {
+        stream->seq = 0;
+        stream->ra_index = 0;
+    }
+    stream->next = pos + size;
+
+    if (!depth || stream->seq < readahead_trigger)
+        return;
+
+    last = ((pos + size - 1) >> KMOD_CACHE_BLOCK_SHIFT) + depth;
+    first = max_t(u64, ((pos + size - 1) >> KMOD_CACHE_BLOCK_SHIFT) + 1, stream->ra_index);
+    if (first > last)
+        return;
+
+    ra = kmalloc(struct_size(ra, blocks, last - first + 1), GFP_KERNEL);
+    if (!ra)
+        return;
+
+    ra->nr = 0;
+    for (index = first; index <= last; index++) {
+        struct kmod_cache_block *cb = kmod_cache_get(index, &created);
+
+        if (!cb)
+            break;
+        if (!created) {
+            kmod_cache_put(cb);
+            continue;
+        }
+
+        set_bit(KMOD_CB_READAHEAD, &cb->flags);
+        ra->blocks[ra->nr++] = cb;
+    }
+    stream->ra_index = index;
+
+    if (!ra->nr) {
+        kfree(ra);
+        return;
+    }
+
+    atomic64_add(ra->nr, &cache_ra_issued);
+    INIT_WORK(&ra->work, kmod_cache_ra_work);
+    queue_work(cache_wq, &ra->work);
+}
+
+bool kmod_cache_enabled(void) {
+    return cache_max_blocks != 0;
+}
+
+ssize_t kmod_cache_read(void *buf, size_t size, loff_t *pos) {
+    ssize_t ret = 0;
+    size_t done = 0;
+
+    if (!size)
+        return 0;
+
+    while (done < size) {
+        loff_t cur = *pos + done;
+        size_t off = cur & (KMOD_CACHE_BLOCK_SIZE - 1);
+        struct kmod_cache_block *cb;
+        bool created;
+        size_t len;
+
+        cb = kmod_cache_get(cur >> KMOD_CACHE_BLOCK_SHIFT, &created);
+        if (!cb) {
+            ret = -ENOMEM;
+            break;
+        }
+
+        if (created) {
+            atomic64_inc(&cache_misses);
+            kmod_cache_load(cb);
+        } else {
+            atomic64_inc(&cache_hits);
+            if (test_and_clear_bit(KMOD_CB_READAHEAD, &cb->flags))
+                atomic64_inc(&cache_ra_hits);
+            wait_for_completion(&cb->ready);
+        }
+
+        if (!test_bit(KMOD_CB_UPTODATE, &cb->flags)) {
+            ret = cb->error;
+            kmod_cache_put(cb);
+            break;
+        }
+
+        len = cb->len > off ? min(cb->len - off, size - done) : 0;
+        memcpy(buf + done, cb->data + off, len);
+        kmod_cache_put(cb);
+        done += len;
+
+        /* Short block: we ran into the end of the device */
+        if (off + len < KMOD_CACHE_BLOCK_SIZE && done < size)
+            break;
+    }
+
+    if (done) {
+        *pos += done;
+        return done;
+    }
+    return ret;
+}
+
+/* Forget every cached block overlapping a range that was just written */
+void kmod_cache_invalidate(loff_t pos, size_t size) {
+    struct kmod_cache_block *cb, *tmp;
+    u64 first, last, index;
+    LIST_HEAD(dispose);
+
+    if (!kmod_cache_enabled() || !size)
+        return;
+
+    first = pos >> KMOD_CACHE_BLOCK_SHIFT;
+    last = (pos + size - 1) >> KMOD_CACHE_BLOCK_SHIFT;
+
+    spin_lock(&cache_lock);
+    if (last - first >= cache_nr_blocks) {
+        list_for_each_entry_safe(cb, tmp, &cache_lru, lru)
+            if (cb->index >= first && cb->index <= last)
+                kmod_cache_unhash(cb, &dispose);
+    } else {
+        for (index = first; index <= last; index++) {
+            cb = kmod_cache_find(index);
+            if (cb)
+                kmod_cache_unhash(cb, &dispose);
+        }
+    }
+    spin_unlock(&cache_lock);
+
+    kmod_cache_dispose(&dispose);
+}
+
+void kmod_cache_get_stats(struct kmod_cache_stats *stats) {
+    stats->hits = atomic64_read(&cache_hits);
+    stats->misses = atomic64_read(&cache_misses);
+    stats->ra_issued = atomic64_read(&cache_ra_issued);
+    stats->ra_hits = atomic64_read(&cache_ra_hits);
+    stats->evictions = atomic64_read(&cache_evictions);
+    stats->nr_blocks = READ_ONCE(cache_nr_blocks);
+    stats->max_blocks = cache_max_blocks;
+    stats->block_size = KMOD_CACHE_BLOCK_SIZE;
+}
+
+bool kmod_cache_init(void) {
+    cache_max_blocks = ((unsigned long)cache_size_mb << 20) >> KMOD_CACHE_BLOCK_SHIFT;
+    if (!cache_max_blocks)
+        return true;
+
+    cache_wq = alloc_workqueue("kmod-ra", WQ_UNBOUND, 0);
+    if (!cache_wq) {
+        cache_max_blocks = 0;
+        return false;
+    }
+
+    printk(KERN_INFO "Block cache: %u blocks of %lu bytes\n",
+           cache_max_blocks, KMOD_CACHE_BLOCK_SIZE);
+    return true;
+}
+
+void kmod_cache_teardown(void) {
+    struct kmod_cache_block *cb, *tmp;
+    LIST_HEAD(dispose);
+
+    if (!cache_wq)
+        return;
+
+    /* Readahead holds its own references, let it finish first */
+    destroy_workqueue(cache_wq);
+    cache_wq = NULL;
+
+    spin_lock(&cache_lock);
+    list_for_each_entry_safe(cb, tmp, &cache_lru, lru)
+        kmod_cache_unhash(cb, &dispose);
+    spin_unlock(&cache_lock);
+
+    kmod_cache_dispose(&dispose);
+    cache_max_blocks = 0;
+}
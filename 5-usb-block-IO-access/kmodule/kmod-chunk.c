@@ -0,0 +1,371 @@
+#include <linux/err.h>
+#include <linux/list.h>
+#include <linux/minmax.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/sched/signal.h>
+#include <linux/semaphore.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+
+#include "kmod-common.h"
+
+/*
+ * Chunked streaming for the copy path. Instead of a vmalloc of the full
+ * request size, every request borrows one of chunk_pairs preallocated pairs
+ * of chunk_kb buffers and moves its data one chunk at a time. For requests
+ * larger than a chunk the device I/O runs on a workqueue, so the user copy
+ * of one chunk overlaps the device I/O of the next:
+ *
+ *   read:  device(N+1) runs while copy_to_user(N)
+ *   write: copy_from_user(N+1) runs while device(N)
+ *
+ * Kernel memory per request is capped at two chunks, and at most
+ * chunk_pairs requests are in the copy path at once. BCOPY uses the same
+ * pairs to move data between two device ranges without leaving the kernel.
+ */
+
+/* Chunk size in KiB */
+static unsigned int chunk_kb = 128;
+module_param(chunk_kb, uint, S_IRUGO);
+
+/* Number of preallocated buffer pairs */
+static unsigned int chunk_pairs = 4;
+module_param(chunk_pairs, uint, S_IRUGO);
+
+struct kmod_chunk_pair {
+    struct list_head    node;
+    char                *buf[2];
+};
+
+/* Device side of one chunk, possibly running on chunk_wq */
+struct kmod_chunk_io {
+    struct work_struct  work;
+    struct completion   done;
+    bool                cached;     /* read through the block cache */
+    char                *buf;
+    size_t              size;
+    loff_t              pos;
+    ssize_t             bytes;
+    bool                write;
+};
+
+static size_t chunk_size;
+static LIST_HEAD(pair_list);
+static DEFINE_SPINLOCK(pair_lock);
+static struct semaphore pair_sem;
+static struct workqueue_struct *chunk_wq;
+
+static struct kmod_chunk_pair *kmod_chunk_get_pair(void) {
+    struct kmod_chunk_pair *pair;
+
+    if (down_interruptible(&pair_sem))
+        return ERR_PTR(-ERESTARTSYS);
+
+    spin_lock(&pair_lock);
+    pair = list_first_entry(&pair_list, struct kmod_chunk_pair, node);
+    list_del(&pair->node);
+    spin_unlock(&pair_lock);
+
+    return pair;
+}
+
+static void kmod_chunk_put_pair(struct kmod_chunk_pair *pair) {
+    spin_lock(&pair_lock);
+    list_add(&pair->node, &pair_list);
+    spin_unlock(&pair_lock);
+    up(&pair_sem);
+}
+
+static void kmod_chunk_work(struct work_struct *work) {
+    struct kmod_chunk_io *io = container_of(work, struct kmod_chunk_io, work);
+    loff_t pos = io->pos;
+
+    if (io->write)
+        io->bytes = kmod_dev_write(io->buf, io->size, &pos);
+    else if (io->cached)
+        io->bytes = kmod_cache_read(io->buf, io->size, &pos);
+    else
+        io->bytes = kmod_dev_read(io->buf, io->size, &pos);
+
+    complete(&io->done);
+}
+
+static void kmod_chunk_io_init(struct kmod_chunk_io *io, char *buf,
+                               bool cached, bool write) {
+    INIT_WORK_ONSTACK(&io->work, kmod_chunk_work);
+    init_completion(&io->done);
+    io->buf = buf;
+    io->cached = cached;
+    io->write = write;
+}
+
+/* Run the device side of a chunk, in the background when async is set */
+static void kmod_chunk_start(struct kmod_chunk_io *io, size_t size, loff_t pos, bool async) {
+    io->size = size;
+    io->pos = pos;
+    reinit_completion(&io->done);
+
+    if (async)
+        queue_work(chunk_wq, &io->work);
+    else
+        kmod_chunk_work(&io->work);
+}
+
+ssize_t kmod_chunk_read(char __user *data, size_t size, loff_t *pos, bool cached) {
+    struct kmod_chunk_pair *pair;
+    struct kmod_chunk_io io[2];
+    bool async = size > chunk_size;
+    bool in_flight = true;
+    size_t done = 0;
+    ssize_t ret = 0;
+    int cur = 0;
+
+    pair = kmod_chunk_get_pair();
+    if (IS_ERR(pair))
+        return PTR_ERR(pair);
+
+    kmod_chunk_io_init(&io[0], pair->buf[0], cached, false);
+    kmod_chunk_io_init(&io[1], pair->buf[1], cached, false);
+
+    kmod_chunk_start(&io[0], min(size, chunk_size), *pos, async);
+    while (in_flight) {
+        size_t len;
+
+        wait_for_completion(&io[cur].done);
+        in_flight = false;
+        if (io[cur].bytes <= 0) {
+            ret = io[cur].bytes;
+            if (ret < 0)
+                printk(KERN_ERR "Failed to read from file, error: %zd\n", ret);
+            break;
+        }
+        len = io[cur].bytes;
+
+        /* Get the device going on the next chunk before copying this one out */
+        if (done + len < size && len == io[cur].size) {
+            kmod_chunk_start(&io[!cur], min(size - done - len, chunk_size),
+                             *pos + done + len, true);
+            in_flight = true;
+        }
+
+        // Copy data back to user space
+        if (copy_to_user(data + done, io[cur].buf, len)) {
+            printk(KERN_ERR "Failed to copy data to user\n");
+            if (in_flight)
+                wait_for_completion(&io[!cur].done);
+            ret = -EFAULT;
+            break;
+        }
+
+        done += len;
+        cur = !cur;
+    }
+
+    destroy_work_on_stack(&io[0].work);
+    destroy_work_on_stack(&io[1].work);
+    kmod_chunk_put_pair(pair);
+
+    if (ret == -EFAULT || !done)
+        return ret;
+
+    *pos += done;
+    return done;
+}
+
+ssize_t kmod_chunk_write(const char __user *data, size_t size, loff_t *pos) {
+    struct kmod_chunk_pair *pair;
+    struct kmod_chunk_io io[2];
+    bool async = size > chunk_size;
+    bool in_flight = false;
+    size_t done = 0, off = 0;
+    ssize_t ret = 0;
+    int cur = 0;
+
+    pair = kmod_chunk_get_pair();
+    if (IS_ERR(pair))
+        return PTR_ERR(pair);
+
+    kmod_chunk_io_init(&io[0], pair->buf[0], false, true);
+    kmod_chunk_io_init(&io[1], pair->buf[1], false, true);
+
+    while (off < size) {
+        size_t len = min(size - off, chunk_size);
+
+        // Copy data from user space while the previous chunk is written
+        if (copy_from_user(io[cur].buf, data + off, len)) {
+            printk(KERN_ERR "Failed to copy data from user\n");
+            ret = -EFAULT;
+            break;
+        }
+
+        if (in_flight) {
+            wait_for_completion(&io[!cur].done);
+            in_flight = false;
+            if (io[!cur].bytes < 0) {
+                ret = io[!cur].bytes;
+                break;
+            }
+            done += io[!cur].bytes;
+            if (io[!cur].bytes != io[!cur].size)
+                break;
+        }
+
+        kmod_chunk_start(&io[cur], len, *pos + off, async);
+        in_flight = true;
+        off += len;
+        cur = !cur;
+    }
+
+    if (in_flight) {
+        wait_for_completion(&io[!cur].done);
+        if (io[!cur].bytes < 0 && !ret)
+            ret = io[!cur].bytes;
+        else if (io[!cur].bytes > 0)
+            done += io[!cur].bytes;
+    }
+
+    destroy_work_on_stack(&io[0].work);
+    destroy_work_on_stack(&io[1].work);
+    kmod_chunk_put_pair(pair);
+
+    if (ret < 0)
+        printk(KERN_ERR "Failed to write to file, error: %zd\n", ret);
+    if (ret == -EFAULT || !done)
+        return ret;
+
+    *pos += done;
+    return done;
+}
+
+/*
+ * Device-to-device copy: the write of chunk N runs on the workqueue while
+ * chunk N+1 is read. When the destination overlaps the source from above
+ * the range is walked backwards, so no chunk is read after being overwritten.
+ */
+ssize_t kmod_chunk_copy(loff_t src, loff_t dst, size_t size) {
+    bool backward = dst > src && dst < src + (loff_t)size;
+    struct kmod_chunk_pair *pair;
+    struct kmod_chunk_io io[2];
+    bool in_flight = false;
+    size_t issued = 0, written = 0;
+    ssize_t ret = 0, bytes;
+    int cur = 0;
+
+    pair = kmod_chunk_get_pair();
+    if (IS_ERR(pair))
+        return PTR_ERR(pair);
+
+    kmod_chunk_io_init(&io[0], pair->buf[0], false, true);
+    kmod_chunk_io_init(&io[1], pair->buf[1], false, true);
+
+    while (issued < size) {
+        size_t len = min(size - issued, chunk_size);
+        loff_t off = backward ? size - issued - len : issued;
+        loff_t pos = src + off;
+
+        // A huge copy must not keep a killed task in the kernel
+        if (fatal_signal_pending(current)) {
+            ret = -EINTR;
+            break;
+        }
+
+        // Read this chunk while the previous one is written
+        bytes = kmod_dev_read(io[cur].buf, len, &pos);
+
+        if (in_flight) {
+            wait_for_completion(&io[!cur].done);
+            in_flight = false;
+            if (io[!cur].bytes != (ssize_t)io[!cur].size) {
+                ret = io[!cur].bytes < 0 ? io[!cur].bytes : -EIO;
+                break;
+            }
+            written += io[!cur].size;
+        }
+
+        if (bytes != (ssize_t)len) {
+            ret = bytes < 0 ? bytes : -EIO;
+            break;
+        }
+
+        kmod_chunk_start(&io[cur], len, dst + off, issued + len < size);
+        in_flight = true;
+        issued += len;
+        cur = !cur;
+    }
+
+    if (in_flight) {
+        wait_for_completion(&io[!cur].done);
+        if (io[!cur].bytes != (ssize_t)io[!cur].size && !ret)
+            ret = io[!cur].bytes < 0 ? io[!cur].bytes : -EIO;
+        else if (io[!cur].bytes == (ssize_t)io[!cur].size)
+            written += io[!cur].size;
+    }
+
+    destroy_work_on_stack(&io[0].work);
+    destroy_work_on_stack(&io[1].work);
+    kmod_chunk_put_pair(pair);
+
+    // Interrupted forward copies report the prefix that made it
+    if (ret == -EINTR)
+        return !backward && written ? written : -EINTR;
+    if (ret < 0) {
+        printk(KERN_ERR "Failed to copy on device, error: %zd\n", ret);
+        return ret;
+    }
+    return size;
+}
+
+static void kmod_chunk_free_pairs(void) {
+    struct kmod_chunk_pair *pair, *tmp;
+
+    list_for_each_entry_safe(pair, tmp, &pair_list, node) {
+        list_del(&pair->node);
+        kvfree(pair->buf[0]);
+        kvfree(pair->buf[1]);
+        kfree(pair);
+    }
+}
+
+bool kmod_chunk_init(void) {
+    struct kmod_chunk_pair *pair;
+    unsigned int i;
+
+    if (!chunk_kb || !chunk_pairs)
+        return false;
+
+    chunk_size = (size_t)chunk_kb << 10;
+    for (i = 0; i < chunk_pairs; i++) {
+        pair = kzalloc(sizeof(*pair), GFP_KERNEL);
+        if (!pair)
+            goto fail;
+        list_add(&pair->node, &pair_list);
+
+        pair->buf[0] = kvmalloc(chunk_size, GFP_KERNEL);
+        pair->buf[1] = kvmalloc(chunk_size, GFP_KERNEL);
+        if (!pair->buf[0] || !pair->buf[1])
+            goto fail;
+    }
+    sema_init(&pair_sem, chunk_pairs);
+
+    chunk_wq = alloc_workqueue("kmod-chunk", WQ_UNBOUND, 0);
+    if (!chunk_wq)
+        goto fail;
+
+    printk(KERN_INFO "Chunked streaming: %u pairs of %zu byte buffers\n", chunk_pairs, chunk_size);
+    return true;
+
+fail:
+    kmod_chunk_free_pairs();
+    return false;
+}
+
+void kmod_chunk_teardown(void) {
+    if (chunk_wq) {
+        destroy_workqueue(chunk_wq);
+        chunk_wq = NULL;
+    }
+    kmod_chunk_free_pairs();
+}
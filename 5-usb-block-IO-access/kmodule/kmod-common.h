@@ -0,0 +1,200 @@
+#ifndef __KMOD_COMMON_H__
+#define __KMOD_COMMON_H__
+
+#include <linux/blk_types.h>
+#include <linux/completion.h>
+#include <linux/errseq.h>
+#include <linux/fs.h>
+#include <linux/mm_types.h>
+#include <linux/types.h>
+
+/* Block device opened in kmod-main.c, the first member when striped, NULL for engine=ram */
+extern struct file *usb_file;
+
+/* Most devices a striped set can span */
+#define KMOD_MAX_MEMBERS 8
+
+/* Device I/O on kernel buffers defined in kmod-main.c */
+ssize_t kmod_dev_backend_rw(void *buf, size_t size, loff_t *pos, bool write);
+struct file *kmod_dev_open(const char *path);
+void    kmod_dev_close(struct file *file);
+ssize_t kmod_file_rw(struct file *file, void *buf, size_t size, loff_t *pos, bool write);
+loff_t  kmod_file_size(struct file *file);
+unsigned int kmod_file_block_size(struct file *file);
+ssize_t kmod_dev_raw_read(void *buf, size_t size, loff_t *pos);
+ssize_t kmod_dev_raw_write(const void *buf, size_t size, loff_t *pos);
+ssize_t kmod_dev_read(void *buf, size_t size, loff_t *pos);
+ssize_t kmod_dev_write(const void *buf, size_t size, loff_t *pos);
+loff_t  kmod_dev_size(void);
+bool    kmod_dev_range_ok(loff_t pos, u64 size);
+unsigned int kmod_dev_block_size(void);
+int     kmod_dev_sync(void);
+
+/* Direct bio engine defined in kmod-bio.c */
+ssize_t kmod_bio_rw(struct file *file, void *buf, size_t size, loff_t *pos, bool write);
+void    kmod_bio_write_begin(void);
+void    kmod_bio_write_end(void);
+
+/* RAID-0 striping over several devices defined in kmod-stripe.c */
+struct seq_file;
+bool    kmod_stripe_open(char **paths, unsigned int nr);
+void    kmod_stripe_close(void);
+bool    kmod_stripe_enabled(void);
+struct file *kmod_stripe_file(unsigned int member);
+loff_t  kmod_stripe_size(void);
+unsigned int kmod_stripe_block_size(void);
+ssize_t kmod_stripe_rw(void *buf, size_t size, loff_t *pos, bool write);
+int     kmod_stripe_discard(loff_t pos, u64 len, bool zero);
+int     kmod_stripe_sync(void);
+void    kmod_stripe_show(struct seq_file *m);
+
+/* In-memory backend for engine=ram defined in kmod-ram.c */
+bool    kmod_ram_open(void);
+void    kmod_ram_close(void);
+bool    kmod_ram_enabled(void);
+loff_t  kmod_ram_size(void);
+ssize_t kmod_ram_rw(void *buf, size_t size, loff_t *pos, bool write);
+int     kmod_ram_discard(loff_t pos, u64 len);
+void    kmod_ram_show(struct seq_file *m);
+
+/* CRC32C block checksums for integrity=1 defined in kmod-integrity.c */
+bool    kmod_integrity_init(void);
+void    kmod_integrity_teardown(void);
+bool    kmod_integrity_enabled(void);
+void    kmod_integrity_update(const void *buf, size_t size, loff_t pos);
+int     kmod_integrity_verify(const void *buf, size_t size, loff_t pos);
+void    kmod_integrity_lock(loff_t pos, u64 len, bool write);
+void    kmod_integrity_unlock(loff_t pos, u64 len, bool write);
+void    kmod_integrity_forget(loff_t pos, u64 len);
+void    kmod_integrity_show(struct seq_file *m);
+
+/* Discard and write-zeroes defined in kmod-discard.c */
+int     kmod_file_discard(struct file *file, loff_t pos, u64 len, bool zero);
+int     kmod_dev_discard(loff_t pos, u64 len);
+int     kmod_dev_write_zeroes(loff_t pos, u64 len);
+
+/* Sequential stream detector state, one per open file */
+struct kmod_stream {
+    loff_t              next;       /* where the next sequential read starts */
+    unsigned int        seq;        /* sequential reads seen in a row */
+    u64                 ra_index;   /* first block not yet prefetched */
+};
+
+/* Block cache defined in kmod-cache.c */
+struct kmod_cache_stats;
+bool    kmod_cache_init(void);
+void    kmod_cache_teardown(void);
+bool    kmod_cache_enabled(void);
+void    kmod_cache_stream(struct kmod_stream *stream, loff_t pos, size_t size);
+ssize_t kmod_cache_read(void *buf, size_t size, loff_t *pos);
+void    kmod_cache_invalidate(loff_t pos, size_t size);
+void    kmod_cache_get_stats(struct kmod_cache_stats *stats);
+
+/* Write-coalescing buffer defined in kmod-wbuf.c */
+bool    kmod_wbuf_init(void);
+void    kmod_wbuf_teardown(void);
+bool    kmod_wbuf_enabled(void);
+ssize_t kmod_wbuf_read(void *buf, size_t size, loff_t *pos);
+ssize_t kmod_wbuf_write(const void *buf, size_t size, loff_t *pos);
+void    kmod_wbuf_sync_range(loff_t pos, size_t size);
+errseq_t kmod_wbuf_sample(void);
+int     kmod_wbuf_flush(errseq_t *since);
+
+/* Chunked double-buffered streaming defined in kmod-chunk.c */
+bool    kmod_chunk_init(void);
+void    kmod_chunk_teardown(void);
+ssize_t kmod_chunk_read(char __user *data, size_t size, loff_t *pos, bool cached);
+ssize_t kmod_chunk_write(const char __user *data, size_t size, loff_t *pos);
+ssize_t kmod_chunk_copy(loff_t src, loff_t dst, size_t size);
+
+/* In-kernel device copy defined in kmod-copy.c */
+ssize_t kmod_dev_copy(loff_t src, loff_t dst, u64 size, bool offload);
+
+/* Size-classed buffer pool defined in kmod-pool.c */
+bool    kmod_pool_init(void);
+void    kmod_pool_teardown(void);
+void    *kmod_pool_alloc(size_t size);
+void    kmod_pool_free(void *buf, size_t size);
+void    kmod_pool_show(struct seq_file *m);
+
+/* One copy-path request handed to a worker thread */
+struct kmod_work_req {
+    struct list_head    node;
+    struct mm_struct    *mm;
+    char __user         *data;
+    size_t              size;
+    loff_t              pos;
+    bool                write;
+    ssize_t             result;
+    struct completion   done;
+};
+
+/* Per-CPU worker threads defined in kmod-workers.c */
+bool    kmod_workers_init(void);
+void    kmod_workers_teardown(void);
+bool    kmod_workers_enabled(void);
+bool    kmod_workers_should_split(size_t size);
+unsigned int kmod_workers_next_slot(unsigned int nr);
+void    kmod_workers_submit(struct kmod_work_req *req, char __user *data, size_t size,
+                            loff_t pos, bool write, unsigned int slot);
+ssize_t kmod_workers_wait(struct kmod_work_req *req);
+ssize_t kmod_workers_rw(char __user *data, size_t size, loff_t *pos, bool write);
+
+/* blk-mq block device defined in kmod-blk.c */
+bool    kmod_blk_init(void);
+void    kmod_blk_teardown(void);
+void    kmod_blk_show(struct seq_file *m);
+
+/* Operation types tracked by kmod-stats.c */
+enum kmod_stat_op {
+    KMOD_STAT_READ,
+    KMOD_STAT_WRITE,
+    KMOD_STAT_READOFFSET,
+    KMOD_STAT_WRITEOFFSET,
+    KMOD_STAT_DISCARD,
+    KMOD_STAT_WRITEZEROES,
+    KMOD_STAT_COPY,
+    KMOD_NR_STAT_OPS,
+};
+
+/* Counters, latency histograms and tracepoints defined in kmod-stats.c */
+bool    kmod_stats_init(void);
+void    kmod_stats_teardown(void);
+u64     kmod_stats_submit(enum kmod_stat_op op, loff_t pos, u64 size);
+void    kmod_stats_complete(enum kmod_stat_op op, u64 size, ssize_t ret, u64 start);
+
+/* Request helpers defined in kmod-ioctl.c */
+ssize_t kmod_read_user(char __user *data, size_t size, loff_t *pos, bool zcopy,
+                       struct kmod_stream *stream);
+ssize_t kmod_write_user(const char __user *data, size_t size, loff_t *pos, bool zcopy);
+
+/* One pinned user buffer and the bios built over it */
+struct kmod_zcopy_req {
+    struct page         **pages;
+    int                 nr_pages;
+    size_t              size;
+    loff_t              pos;
+    bool                write;
+    atomic_t            pending;
+    blk_status_t        status;
+    struct completion   done;
+};
+
+/* Zero-copy helpers defined in kmod-zcopy.c */
+bool    kmod_zcopy_capable(const void __user *buf, size_t size, loff_t pos);
+int     kmod_zcopy_submit(struct kmod_zcopy_req *req, void __user *buf, size_t size, loff_t pos, bool write);
+ssize_t kmod_zcopy_wait(struct kmod_zcopy_req *req);
+ssize_t kmod_zcopy_rw(void __user *buf, size_t size, loff_t pos, bool write);
+
+/* Asynchronous ring helpers defined in kmod-ring.c */
+struct kmod_ring;
+struct poll_table_struct;
+struct kmod_ring *kmod_ring_setup(void __user *arg);
+long    kmod_ring_enter(struct kmod_ring *ring, void __user *arg);
+long    kmod_ring_submit(struct kmod_ring *ring, void __user *arg);
+long    kmod_ring_set_eventfd(struct kmod_ring *ring, void __user *arg);
+__poll_t kmod_ring_poll(struct kmod_ring *ring, struct file *file, struct poll_table_struct *wait);
+int     kmod_ring_mmap(struct kmod_ring *ring, struct vm_area_struct *vma);
+void    kmod_ring_destroy(struct kmod_ring *ring);
+
+#endif
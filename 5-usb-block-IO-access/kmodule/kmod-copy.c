@@ -0,0 +1,70 @@
+#include <linux/fs.h>
+#include <linux/minmax.h>
+#include <linux/sched/signal.h>
+
+#include "kmod-common.h"
+
+/*
+ * In-kernel copy between two ranges of the device for BCOPY. When the
+ * module is backed by a regular file and the ranges don't overlap, the
+ * copy is first offered to vfs_copy_file_range(), which lets the
+ * filesystem reflink or copy server-side. Block devices have no copy
+ * offload in the block layer, so they, overlapping ranges and whatever the
+ * offload leaves over go through kmod_chunk_copy()'s pipelined read/write
+ * loop, as does everything in integrity mode so checksums follow the data.
+ * Either way the data never crosses the user boundary.
+ *
+ * A fatal signal stops the copy between chunks. The bytes copied up to that
+ * point are returned, or EINTR if there are none (or the copy was running
+ * backward, so what is done isn't a prefix).
+ */
+
+/* Bytes the backing file copied itself, stopping at the first refusal */
+static size_t kmod_copy_offload(loff_t src, loff_t dst, size_t size) {
+    size_t done = 0;
+    ssize_t bytes;
+
+    if (!usb_file || kmod_stripe_enabled() || !S_ISREG(file_inode(usb_file)->i_mode))
+        return 0;
+    if (kmod_integrity_enabled())
+        return 0;
+    if (src < dst + (loff_t)size && dst < src + (loff_t)size)
+        return 0;
+
+    /* The copy reads and writes the file directly, so pending writes go first */
+    kmod_wbuf_sync_range(src, size);
+    kmod_wbuf_sync_range(dst, size);
+
+    while (done < size && !fatal_signal_pending(current)) {
+        bytes = vfs_copy_file_range(usb_file, src + done, usb_file, dst + done,
+                                    size - done, 0);
+        if (bytes <= 0)
+            break;
+        done += bytes;
+    }
+
+    kmod_cache_invalidate(dst, done);
+    return done;
+}
+
+ssize_t kmod_dev_copy(loff_t src, loff_t dst, u64 size, bool offload) {
+    size_t done = 0;
+    ssize_t bytes;
+
+    if (!kmod_dev_range_ok(src, size) || !kmod_dev_range_ok(dst, size))
+        return -EINVAL;
+    if (!size || src == dst)
+        return size;
+
+    if (offload)
+        done = kmod_copy_offload(src, dst, size);
+    if (done == size)
+        return size;
+
+    bytes = kmod_chunk_copy(src + done, dst + done, size - done);
+    if (bytes == -EINTR && done)
+        return done;
+    if (bytes < 0)
+        return bytes;
+    return done + bytes;
+}
@@ -0,0 +1,118 @@
+#include <linux/blkdev.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/minmax.h>
+#include <linux/pagemap.h>
+#include <linux/sizes.h>
+#include <linux/string.h>
+
+#include "kmod-common.h"
+
+/*
+ * Discard and write-zeroes for BDISCARD/BWRITEZEROES and the block device.
+ * No data crosses the user boundary: on a block device the range goes to
+ * blkdev_issue_discard()/blkdev_issue_zeroout(), and the latter writes
+ * zero pages from the kernel when the device has no zeroing offload. A
+ * regular file backing the module gets hole punching or zero ranges from
+ * its filesystem, with a kernel zero fill as the last resort. Pending
+ * coalesced writes in the range go out first and cached copies of it are
+ * dropped afterwards, so later reads see the result.
+ */
+
+/* Write zeroes through the engine when nothing better is available */
+static int kmod_zero_fill(struct file *file, loff_t pos, u64 len) {
+    size_t chunk = min_t(u64, len, SZ_1M);
+    ssize_t bytes;
+    char *zeroes;
+    int ret = 0;
+
+    zeroes = kmod_pool_alloc(chunk);
+    if (!zeroes)
+        return -ENOMEM;
+    memset(zeroes, 0, chunk);
+
+    while (len) {
+        size_t size = min_t(u64, len, chunk);
+
+        bytes = kmod_file_rw(file, zeroes, size, &pos, true);
+        if (bytes != size) {
+            ret = bytes < 0 ? bytes : -EIO;
+            break;
+        }
+        len -= size;
+    }
+
+    kmod_pool_free(zeroes, chunk);
+    return ret;
+}
+
+/* Discard, or with zero set write zeroes, on one opened device */
+int kmod_file_discard(struct file *file, loff_t pos, u64 len, bool zero) {
+    struct block_device *bdev;
+    loff_t end = pos + len - 1;
+    int ret;
+
+    if (!S_ISBLK(file_inode(file)->i_mode)) {
+        if (!zero)
+            return vfs_fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len);
+
+        ret = vfs_fallocate(file, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, pos, len);
+        if (ret == -EOPNOTSUPP)
+            ret = kmod_zero_fill(file, pos, len);
+        return ret;
+    }
+
+    bdev = file_bdev(file);
+    if (!zero && !bdev_max_discard_sectors(bdev))
+        return -EOPNOTSUPP;
+
+    /* The commands bypass the page cache, so write it back and drop it around them */
+    ret = filemap_write_and_wait_range(file->f_mapping, pos, end);
+    if (ret)
+        return ret;
+
+    kmod_bio_write_begin();
+    if (zero)
+        ret = blkdev_issue_zeroout(bdev, pos >> SECTOR_SHIFT, len >> SECTOR_SHIFT,
+                                   GFP_KERNEL, 0);
+    else
+        ret = blkdev_issue_discard(bdev, pos >> SECTOR_SHIFT, len >> SECTOR_SHIFT,
+                                   GFP_KERNEL);
+    kmod_bio_write_end();
+
+    invalidate_inode_pages2_range(file->f_mapping, pos >> PAGE_SHIFT, end >> PAGE_SHIFT);
+    return ret;
+}
+
+static int kmod_dev_discard_range(loff_t pos, u64 len, bool zero) {
+    int ret;
+
+    if (!len)
+        return 0;
+    if (!kmod_dev_range_ok(pos, len) || ((pos | len) & (kmod_dev_block_size() - 1)))
+        return -EINVAL;
+
+    /* Earlier writes to the range must not land on top of the result */
+    kmod_wbuf_sync_range(pos, len);
+
+    kmod_integrity_lock(pos, len, true);
+    if (kmod_ram_enabled())
+        ret = kmod_ram_discard(pos, len);
+    else if (kmod_stripe_enabled())
+        ret = kmod_stripe_discard(pos, len, zero);
+    else
+        ret = kmod_file_discard(usb_file, pos, len, zero);
+
+    kmod_cache_invalidate(pos, len);
+    kmod_integrity_forget(pos, len);
+    kmod_integrity_unlock(pos, len, true);
+    return ret;
+}
+
+int kmod_dev_discard(loff_t pos, u64 len) {
+    return kmod_dev_discard_range(pos, len, false);
+}
+
+int kmod_dev_write_zeroes(loff_t pos, u64 len) {
+    return kmod_dev_discard_range(pos, len, true);
+}
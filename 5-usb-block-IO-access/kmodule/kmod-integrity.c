@@ -0,0 +1,244 @@
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/crc32c.h>
+#include <linux/log2.h>
+#include <linux/minmax.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/rwsem.h>
+#include <linux/seq_file.h>
+#include <linux/xarray.h>
+
+#include "kmod-common.h"
+
+/*
+ * End-to-end CRC32C checksums for device blocks, enabled with integrity=1.
+ * Every integrity_kb block written through the module gets its CRC32C in a
+ * sparse xarray indexed by block number; reads recompute and compare it
+ * and fail with -EBADMSG on a mismatch. Blocks never written through the
+ * module have no checksum and are not checked. crc32c() picks the
+ * SSE4.2/PCLMUL (or other architecture) implementation when available.
+ *
+ * The checks sit directly on top of the backend, below the write buffer
+ * and the cache, so they cover exactly what went to and came back from the
+ * device. Blocks a request only partly covers are read back whole to
+ * compute or check their CRC. Zero-copy and copy offload bypass this layer,
+ * so both are turned off in integrity mode; discards drop the checksums of
+ * the blocks they cover.
+ *
+ * The device I/O and the CRC update or check that follows it happen under
+ * a lock on the blocks involved, shared for reads and exclusive for writes
+ * and discards. Otherwise two writes into one block could store their CRCs
+ * in the opposite order to their data, or a read could check old data
+ * against a new CRC. The locks are a small array hashed by block number,
+ * always taken in index order.
+ */
+
+/* Enable checksumming */
+static unsigned int integrity = 0;
+module_param(integrity, uint, S_IRUGO);
+
+/* Checksummed block size in KiB, a power of two */
+static unsigned int integrity_kb = 4;
+module_param(integrity_kb, uint, S_IRUGO);
+
+static DEFINE_XARRAY(crc_table);
+static unsigned int crc_shift;
+static size_t crc_block;
+
+#define KMOD_CRC_LOCKS 64
+
+static struct rw_semaphore crc_locks[KMOD_CRC_LOCKS];
+static struct lock_class_key crc_lock_keys[KMOD_CRC_LOCKS];
+
+static atomic64_t crc_verified = ATOMIC64_INIT(0);
+static atomic64_t crc_mismatches = ATOMIC64_INIT(0);
+static atomic64_t crc_updated = ATOMIC64_INIT(0);
+static atomic64_t crc_readback = ATOMIC64_INIT(0);
+
+bool kmod_integrity_enabled(void) {
+    return crc_shift != 0;
+}
+
+/* Locks covering the blocks of [pos, pos + len), all of them for a long range */
+static void kmod_integrity_lock_set(unsigned long *set, loff_t pos, u64 len) {
+    u64 block = pos >> crc_shift, last = (pos + len - 1) >> crc_shift;
+
+    if (last - block >= KMOD_CRC_LOCKS - 1) {
+        bitmap_fill(set, KMOD_CRC_LOCKS);
+        return;
+    }
+
+    bitmap_zero(set, KMOD_CRC_LOCKS);
+    for (; block <= last; block++)
+        __set_bit(block % KMOD_CRC_LOCKS, set);
+}
+
+/* Hold off other I/O to the blocks of a range while its CRCs are updated or checked */
+void kmod_integrity_lock(loff_t pos, u64 len, bool write) {
+    DECLARE_BITMAP(set, KMOD_CRC_LOCKS);
+    unsigned int i;
+
+    if (!kmod_integrity_enabled() || !len)
+        return;
+
+    kmod_integrity_lock_set(set, pos, len);
+    for_each_set_bit(i, set, KMOD_CRC_LOCKS) {
+        if (write)
+            down_write(&crc_locks[i]);
+        else
+            down_read(&crc_locks[i]);
+    }
+}
+
+void kmod_integrity_unlock(loff_t pos, u64 len, bool write) {
+    DECLARE_BITMAP(set, KMOD_CRC_LOCKS);
+    unsigned int i;
+
+    if (!kmod_integrity_enabled() || !len)
+        return;
+
+    kmod_integrity_lock_set(set, pos, len);
+    for_each_set_bit(i, set, KMOD_CRC_LOCKS) {
+        if (write)
+            up_write(&crc_locks[i]);
+        else
+            up_read(&crc_locks[i]);
+    }
+}
+
+static u32 kmod_crc(const void *buf) {
+    return crc32c(~0U, buf, crc_block);
+}
+
+/* CRC of a whole block as it is on the device now, for partly covered blocks */
+static int kmod_integrity_block_crc(u64 block, u32 *crc) {
+    loff_t pos = block << crc_shift;
+    ssize_t bytes;
+    void *buf;
+
+    buf = kmod_pool_alloc(crc_block);
+    if (!buf)
+        return -ENOMEM;
+
+    atomic64_inc(&crc_readback);
+    bytes = kmod_dev_backend_rw(buf, crc_block, &pos, false);
+    if (bytes == (ssize_t)crc_block)
+        *crc = kmod_crc(buf);
+
+    kmod_pool_free(buf, crc_block);
+    if (bytes < 0)
+        return bytes;
+    return bytes == (ssize_t)crc_block ? 0 : -EIO;
+}
+
+/* Record the CRCs of every block a successful write touched */
+void kmod_integrity_update(const void *buf, size_t size, loff_t pos) {
+    u64 block = pos >> crc_shift, last = (pos + size - 1) >> crc_shift;
+    u32 crc;
+    int err;
+
+    for (; block <= last; block++) {
+        loff_t start = block << crc_shift;
+
+        if (start >= pos && start + crc_block <= pos + size) {
+            crc = kmod_crc(buf + (start - pos));
+            err = 0;
+        } else {
+            err = kmod_integrity_block_crc(block, &crc);
+        }
+
+        /* A block we can't vouch for must not fail later reads */
+        if (!err)
+            err = xa_err(xa_store(&crc_table, block, xa_mk_value(crc), GFP_NOIO));
+        if (err)
+            xa_erase(&crc_table, block);
+        else
+            atomic64_inc(&crc_updated);
+    }
+}
+
+/* Check the CRCs of every block a successful read touched */
+int kmod_integrity_verify(const void *buf, size_t size, loff_t pos) {
+    u64 block = pos >> crc_shift, last = (pos + size - 1) >> crc_shift;
+    void *entry;
+    u32 crc;
+    int err;
+
+    for (; block <= last; block++) {
+        loff_t start = block << crc_shift;
+
+        entry = xa_load(&crc_table, block);
+        if (!entry)
+            continue;
+
+        if (start >= pos && start + crc_block <= pos + size) {
+            crc = kmod_crc(buf + (start - pos));
+        } else {
+            err = kmod_integrity_block_crc(block, &crc);
+            if (err)
+                return err;
+        }
+
+        atomic64_inc(&crc_verified);
+        if (crc != xa_to_value(entry)) {
+            atomic64_inc(&crc_mismatches);
+            pr_err_ratelimited("CRC32C mismatch in block %llu (offset %lld): %08x, expected %08lx\n",
+                               block, start, crc, xa_to_value(entry));
+            return -EBADMSG;
+        }
+    }
+    return 0;
+}
+
+/* The range no longer holds what was checksummed */
+void kmod_integrity_forget(loff_t pos, u64 len) {
+    unsigned long index;
+    void *entry;
+
+    if (!kmod_integrity_enabled() || !len)
+        return;
+
+    xa_for_each_range(&crc_table, index, entry, pos >> crc_shift, (pos + len - 1) >> crc_shift)
+        xa_erase(&crc_table, index);
+}
+
+void kmod_integrity_show(struct seq_file *m) {
+    if (!kmod_integrity_enabled()) {
+        seq_puts(m, "integrity disabled\n");
+        return;
+    }
+
+    seq_printf(m, "block_size %zu\n", crc_block);
+    seq_printf(m, "verified %lld\nmismatches %lld\nupdated %lld\nreadback %lld\n",
+               atomic64_read(&crc_verified), atomic64_read(&crc_mismatches),
+               atomic64_read(&crc_updated), atomic64_read(&crc_readback));
+}
+
+void kmod_integrity_teardown(void) {
+    xa_destroy(&crc_table);
+    crc_shift = 0;
+}
+
+bool kmod_integrity_init(void) {
+    unsigned int i;
+
+    if (!integrity)
+        return true;
+
+    if (integrity_kb < 1 || !is_power_of_2(integrity_kb) ||
+        ((size_t)integrity_kb << 10) < kmod_dev_block_size()) {
+        printk(KERN_ERR "integrity_kb must be a power of two no smaller than the device block\n");
+        return false;
+    }
+
+    /* One class per lock, lockdep sees them nested in index order */
+    for (i = 0; i < KMOD_CRC_LOCKS; i++)
+        __init_rwsem(&crc_locks[i], "kmod_crc_lock", &crc_lock_keys[i]);
+
+    crc_block = (size_t)integrity_kb << 10;
+    crc_shift = ilog2(crc_block);
+    printk(KERN_INFO "Integrity: CRC32C per %zu byte block (%s)\n", crc_block,
+           crc32c_impl());
+    return true;
+}
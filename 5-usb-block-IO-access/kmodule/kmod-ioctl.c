@@ -9,6 +9,8 @@
 #include <linux/kref.h>
 #include <linux/kthread.h>
 #include <linux/limits.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
 #include <linux/rwsem.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
@@ -27,6 +29,8 @@
 #include <linux/nospec.h>
 
 #include "../ioctl-defines.h"
+#include "../ioctl-defines-ext.h"
+#include "kmod-common.h"
 
 #include <linux/vmalloc.h>
 
@@ -35,181 +39,337 @@ static dev_t            dev = 0;
 static struct class*    kmod_class;
 static struct cdev      kmod_cdev;
 
-/* Current offset in the device */
-static unsigned long current_offset = 0;
-
-/* Buffers for different operation requests */
-struct block_rw_ops rw_request;
-struct block_rwoffset_ops rwoffset_request;
-
-/* External declarations */
-extern struct file *usb_file;
+/* Per-open-file state, hung off file->private_data */
+struct kmod_file {
+    /* Serializes the cursor and request buffers below */
+    struct mutex                lock;
+    
+    /* Current offset in the device */
+    loff_t                      current_offset;
+    
+    /* Buffers for different operation requests */
+    struct block_rw_ops         rw_request;
+    struct block_rwoffset_ops   rwoffset_request;
+    struct block_rwoffset64_ops rwoffset64_request;
+    
+    /* Sequential stream detector for the block cache */
+    struct kmod_stream          stream;
+    
+    /* Optional async ring set up by BRINGSETUP */
+    struct kmod_ring            *ring;
+    
+    /* Write buffer errors this file has already been told about */
+    errseq_t                    wbuf_since;
+};
 
 bool kmod_ioctl_init(void);
 void kmod_ioctl_teardown(void);
 
-static long kmod_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
-    char* kernbuf;
+/*
+ * Read size bytes at *pos into a user buffer, pinning it when zcopy is set.
+ * Reads that belong to a stream are served through the block cache.
+ */
+ssize_t kmod_read_user(char __user *data, size_t size, loff_t *pos, bool zcopy,
+                       struct kmod_stream *stream) {
+    bool cached = stream && kmod_cache_enabled();
+    ssize_t bytes;
+    
+    if (zcopy && kmod_zcopy_capable(data, size, *pos)) {
+        bytes = kmod_zcopy_rw(data, size, *pos, false);
+        if (bytes > 0)
+            *pos += bytes;
+        return bytes;
+    }
+    
+    // Large requests outside the cache run as parallel pieces on the workers
+    if (kmod_workers_should_split(size) && !cached)
+        return kmod_workers_rw(data, size, pos, false);
+    
+    // The whole request is one step of the stream, however many chunks it takes
+    if (cached)
+        kmod_cache_stream(stream, *pos, size);
+    
+    // Stream through the preallocated chunk buffers
+    return kmod_chunk_read(data, size, pos, cached);
+}
+
+/* Write size bytes from a user buffer at *pos, pinning it when zcopy is set */
+ssize_t kmod_write_user(const char __user *data, size_t size, loff_t *pos, bool zcopy) {
+    ssize_t bytes;
+    
+    if (zcopy && kmod_zcopy_capable(data, size, *pos)) {
+        bytes = kmod_zcopy_rw((void __user *)data, size, *pos, true);
+        if (bytes > 0)
+            *pos += bytes;
+        return bytes;
+    }
+    
+    if (kmod_workers_should_split(size))
+        return kmod_workers_rw((char __user *)data, size, pos, true);
+    
+    // Stream through the preallocated chunk buffers
+    return kmod_chunk_write(data, size, pos);
+}
+
+/*
+ * Run every segment of a BREADV/BWRITEV request. Zero-copy and worker
+ * segments are issued first, under one plug, and stay in flight while
+ * the remaining copy-path segments run here one after another.
+ */
+static long kmod_vec_rw(void __user *arg, bool write) {
+    enum kmod_stat_op op = write ? KMOD_STAT_WRITEOFFSET : KMOD_STAT_READOFFSET;
+    struct kmod_zcopy_req *zreqs = NULL;
+    struct kmod_work_req *wreqs = NULL;
+    struct block_vec_ops vec;
+    u64 *starts;
+    struct kmod_seg *segs;
+    struct blk_plug plug;
+    unsigned int slot = 0;
+    long total = 0;
+    u32 i;
+    
+    if (copy_from_user(&vec, arg, sizeof(vec))) {
+        printk(KERN_ERR "Failed to copy request from user\n");
+        return -EFAULT;
+    }
+    
+    if (!vec.nr_segs || vec.nr_segs > KMOD_VEC_MAX_SEGS)
+        return -EINVAL;
+    
+    // Per-request state comes from the buffer pool rather than the allocator
+    segs = kmod_pool_alloc(vec.nr_segs * sizeof(*segs));
+    starts = kmod_pool_alloc(vec.nr_segs * sizeof(*starts));
+    if (vec.flags & KMOD_VEC_ZCOPY) {
+        zreqs = kmod_pool_alloc(vec.nr_segs * sizeof(*zreqs));
+        if (zreqs)
+            memset(zreqs, 0, vec.nr_segs * sizeof(*zreqs));
+    }
+    if (kmod_workers_enabled()) {
+        wreqs = kmod_pool_alloc(vec.nr_segs * sizeof(*wreqs));
+        if (wreqs)
+            memset(wreqs, 0, vec.nr_segs * sizeof(*wreqs));
+        slot = kmod_workers_next_slot(vec.nr_segs);
+    }
+    if (!segs || !starts || ((vec.flags & KMOD_VEC_ZCOPY) && !zreqs) ||
+        (kmod_workers_enabled() && !wreqs)) {
+        total = -ENOMEM;
+        goto out;
+    }
+    
+    if (copy_from_user(segs, u64_to_user_ptr(vec.segs), vec.nr_segs * sizeof(*segs))) {
+        printk(KERN_ERR "Failed to copy segments from user\n");
+        total = -EFAULT;
+        goto out;
+    }
+    memset(starts, 0, vec.nr_segs * sizeof(*starts));
+    
+    // Issue everything that can run asynchronously, zero-copy bios under one plug
+    blk_start_plug(&plug);
+    for (i = 0; i < vec.nr_segs; i++) {
+        void __user *data = u64_to_user_ptr(segs[i].data);
+        unsigned int size = segs[i].size;
+        loff_t pos = segs[i].offset;
+        
+        // The result field came from the caller, don't trust it
+        segs[i].result = 0;
+        if (!size || size > INT_MAX) {
+            segs[i].result = size ? -EINVAL : 0;
+            continue;
+        }
+        
+        // Same bounds as BREADOFFSET64, a bad segment fails on its own
+        if (!kmod_dev_range_ok(pos, size)) {
+            segs[i].result = -EINVAL;
+            continue;
+        }
+        
+        starts[i] = kmod_stats_submit(op, pos, size);
+        if (zreqs && kmod_zcopy_capable(data, size, pos)) {
+            segs[i].result = kmod_zcopy_submit(&zreqs[i], data, size, pos, write);
+            if (!zreqs[i].pages)
+                kmod_stats_complete(op, size, segs[i].result, starts[i]);
+            continue;
+        }
+        
+        // Copy-path segments run side by side on the worker threads
+        if (wreqs) {
+            kmod_workers_submit(&wreqs[i], data, size, pos, write, slot + i);
+            continue;
+        }
+        
+        // Synchronous, left for after the plug so it doesn't hold back the rest
+        segs[i].result = -EINPROGRESS;
+    }
+    blk_finish_plug(&plug);
+    
+    for (i = 0; i < vec.nr_segs; i++) {
+        void __user *data = u64_to_user_ptr(segs[i].data);
+        loff_t pos = segs[i].offset;
+        
+        if (segs[i].result != -EINPROGRESS)
+            continue;
+        
+        if (write)
+            segs[i].result = kmod_write_user(data, segs[i].size, &pos, false);
+        else
+            segs[i].result = kmod_read_user(data, segs[i].size, &pos, false, NULL);
+        kmod_stats_complete(op, segs[i].size, segs[i].result, starts[i]);
+    }
+    
+    for (i = 0; i < vec.nr_segs; i++) {
+        if (zreqs && zreqs[i].pages) {
+            segs[i].result = kmod_zcopy_wait(&zreqs[i]);
+            kmod_stats_complete(op, segs[i].size, segs[i].result, starts[i]);
+        } else if (wreqs && wreqs[i].mm) {
+            segs[i].result = kmod_workers_wait(&wreqs[i]);
+            kmod_stats_complete(op, segs[i].size, segs[i].result, starts[i]);
+        }
+        if (segs[i].result > 0)
+            total += segs[i].result;
+    }
+    
+    // Hand the per-segment results back
+    if (copy_to_user(u64_to_user_ptr(vec.segs), segs, vec.nr_segs * sizeof(*segs))) {
+        printk(KERN_ERR "Failed to copy segment results to user\n");
+        total = -EFAULT;
+    }
+    
+out:
+    kmod_pool_free(wreqs, vec.nr_segs * sizeof(*wreqs));
+    kmod_pool_free(zreqs, vec.nr_segs * sizeof(*zreqs));
+    kmod_pool_free(starts, vec.nr_segs * sizeof(*starts));
+    kmod_pool_free(segs, vec.nr_segs * sizeof(*segs));
+    return total;
+}
+
+/* Cursor-based and offset requests, called with ctx->lock held */
+static long kmod_ioctl_rw(struct kmod_file *ctx, unsigned int cmd, unsigned long arg) {
     unsigned int size, offset;
+    enum kmod_stat_op op;
+    char __user *data;
     ssize_t bytes;
+    u64 size64, start;
     loff_t pos;
-    
-    printk(KERN_INFO "IOCTL command received: %u\n", cmd);
+    bool zcopy;
     
     switch (cmd)
     {
         case BREAD:
+        case BREADZC:
             // Copy the request struct from user space
-            if (copy_from_user(&rw_request, (void *)arg, sizeof(struct block_rw_ops))) {
+            if (copy_from_user(&ctx->rw_request, (void *)arg, sizeof(struct block_rw_ops))) {
                 printk(KERN_ERR "Failed to copy request from user\n");
                 return -EFAULT;
             }
             
-            size = rw_request.size;
-            pos = current_offset;
-            printk(KERN_INFO "READ: size=%u, offset=%lld\n", size, pos);
-            
-            // Allocate kernel buffer for the operation
-            kernbuf = vmalloc(size);
-            if (!kernbuf) {
-                printk(KERN_ERR "Failed to allocate kernel buffer\n");
-                return -ENOMEM;
-            }
+            size = ctx->rw_request.size;
+            pos = ctx->current_offset;
+            zcopy = (cmd == BREADZC);
+            start = kmod_stats_submit(KMOD_STAT_READ, pos, size);
             
-            // Read from file
-            bytes = kernel_read(usb_file, kernbuf, size, &pos);
-            if (bytes < 0) {
-                printk(KERN_ERR "Failed to read from file, error: %zd\n", bytes);
-                vfree(kernbuf);
+            bytes = kmod_read_user(ctx->rw_request.data, size, &pos, zcopy, &ctx->stream);
+            kmod_stats_complete(KMOD_STAT_READ, size, bytes, start);
+            if (bytes < 0)
                 return bytes;
-            }
-            
-            // Copy data back to user space
-            if (copy_to_user(rw_request.data, kernbuf, bytes)) {
-                printk(KERN_ERR "Failed to copy data to user\n");
-                vfree(kernbuf);
-                return -EFAULT;
-            }
             
-            vfree(kernbuf);
-            current_offset = pos;  // Update the current offset
-            printk(KERN_INFO "READ completed: read %zd bytes, new offset=%lu\n", bytes, current_offset);
+            ctx->current_offset = pos;  // Update the current offset
             return bytes;
             
         case BWRITE:
+        case BWRITEZC:
             // Copy the request struct from user space
-            if (copy_from_user(&rw_request, (void *)arg, sizeof(struct block_rw_ops))) {
+            if (copy_from_user(&ctx->rw_request, (void *)arg, sizeof(struct block_rw_ops))) {
                 printk(KERN_ERR "Failed to copy request from user\n");
                 return -EFAULT;
             }
             
-            size = rw_request.size;
-            pos = current_offset;
-            printk(KERN_INFO "WRITE: size=%u, offset=%lld\n", size, pos);
-            
-            // Allocate kernel buffer for the operation
-            kernbuf = vmalloc(size);
-            if (!kernbuf) {
-                printk(KERN_ERR "Failed to allocate kernel buffer\n");
-                return -ENOMEM;
-            }
+            size = ctx->rw_request.size;
+            pos = ctx->current_offset;
+            zcopy = (cmd == BWRITEZC);
+            start = kmod_stats_submit(KMOD_STAT_WRITE, pos, size);
             
-            // Copy data from user space
-            if (copy_from_user(kernbuf, rw_request.data, size)) {
-                printk(KERN_ERR "Failed to copy data from user\n");
-                vfree(kernbuf);
-                return -EFAULT;
-            }
-            
-            // Write to file
-            bytes = kernel_write(usb_file, kernbuf, size, &pos);
-            if (bytes < 0) {
-                printk(KERN_ERR "Failed to write to file, error: %zd\n", bytes);
-                vfree(kernbuf);
+            bytes = kmod_write_user(ctx->rw_request.data, size, &pos, zcopy);
+            kmod_stats_complete(KMOD_STAT_WRITE, size, bytes, start);
+            if (bytes < 0)
                 return bytes;
-            }
             
-            vfree(kernbuf);
-            current_offset = pos;  // Update the current offset
-            printk(KERN_INFO "WRITE completed: wrote %zd bytes, new offset=%lu\n", bytes, current_offset);
+            ctx->current_offset = pos;  // Update the current offset
             return bytes;
             
         case BREADOFFSET:
+        case BREADOFFSETZC:
             // Copy the request struct from user space
-            if (copy_from_user(&rwoffset_request, (void *)arg, sizeof(struct block_rwoffset_ops))) {
+            if (copy_from_user(&ctx->rwoffset_request, (void *)arg, sizeof(struct block_rwoffset_ops))) {
                 printk(KERN_ERR "Failed to copy request from user\n");
                 return -EFAULT;
             }
             
-            size = rwoffset_request.size;
-            offset = rwoffset_request.offset;
+            size = ctx->rwoffset_request.size;
+            offset = ctx->rwoffset_request.offset;
             pos = offset;
-            printk(KERN_INFO "READOFFSET: size=%u, offset=%u\n", size, offset);
+            zcopy = (cmd == BREADOFFSETZC);
+            start = kmod_stats_submit(KMOD_STAT_READOFFSET, pos, size);
             
-            // Allocate kernel buffer for the operation
-            kernbuf = vmalloc(size);
-            if (!kernbuf) {
-                printk(KERN_ERR "Failed to allocate kernel buffer\n");
-                return -ENOMEM;
-            }
-            
-            // Read from file
-            bytes = kernel_read(usb_file, kernbuf, size, &pos);
-            if (bytes < 0) {
-                printk(KERN_ERR "Failed to read from file, error: %zd\n", bytes);
-                vfree(kernbuf);
+            bytes = kmod_read_user(ctx->rwoffset_request.data, size, &pos, zcopy, NULL);
+            kmod_stats_complete(KMOD_STAT_READOFFSET, size, bytes, start);
+            if (bytes < 0)
                 return bytes;
-            }
-            
-            // Copy data back to user space
-            if (copy_to_user(rwoffset_request.data, kernbuf, bytes)) {
-                printk(KERN_ERR "Failed to copy data to user\n");
-                vfree(kernbuf);
-                return -EFAULT;
-            }
             
-            vfree(kernbuf);
-            current_offset = pos;  // Update the current offset
-            printk(KERN_INFO "READOFFSET completed: read %zd bytes, new offset=%lu\n", bytes, current_offset);
+            ctx->current_offset = pos;  // Update the current offset
             return bytes;
             
         case BWRITEOFFSET:
+        case BWRITEOFFSETZC:
             // Copy the request struct from user space
-            if (copy_from_user(&rwoffset_request, (void *)arg, sizeof(struct block_rwoffset_ops))) {
+            if (copy_from_user(&ctx->rwoffset_request, (void *)arg, sizeof(struct block_rwoffset_ops))) {
                 printk(KERN_ERR "Failed to copy request from user\n");
                 return -EFAULT;
             }
             
-            size = rwoffset_request.size;
-            offset = rwoffset_request.offset;
+            size = ctx->rwoffset_request.size;
+            offset = ctx->rwoffset_request.offset;
             pos = offset;
-            printk(KERN_INFO "WRITEOFFSET: size=%u, offset=%u\n", size, offset);
+            zcopy = (cmd == BWRITEOFFSETZC);
+            start = kmod_stats_submit(KMOD_STAT_WRITEOFFSET, pos, size);
             
-            // Allocate kernel buffer for the operation
-            kernbuf = vmalloc(size);
-            if (!kernbuf) {
-                printk(KERN_ERR "Failed to allocate kernel buffer\n");
-                return -ENOMEM;
-            }
+            bytes = kmod_write_user(ctx->rwoffset_request.data, size, &pos, zcopy);
+            kmod_stats_complete(KMOD_STAT_WRITEOFFSET, size, bytes, start);
+            if (bytes < 0)
+                return bytes;
             
-            // Copy data from user space
-            if (copy_from_user(kernbuf, rwoffset_request.data, size)) {
-                printk(KERN_ERR "Failed to copy data from user\n");
-                vfree(kernbuf);
+            ctx->current_offset = pos;  // Update the current offset
+            return bytes;
+            
+        case BREADOFFSET64:
+        case BWRITEOFFSET64:
+            // Copy the request struct from user space
+            if (copy_from_user(&ctx->rwoffset64_request, (void *)arg, sizeof(struct block_rwoffset64_ops))) {
+                printk(KERN_ERR "Failed to copy request from user\n");
                 return -EFAULT;
             }
             
-            // Write to file
-            bytes = kernel_write(usb_file, kernbuf, size, &pos);
-            if (bytes < 0) {
-                printk(KERN_ERR "Failed to write to file, error: %zd\n", bytes);
-                vfree(kernbuf);
-                return bytes;
+            size64 = ctx->rwoffset64_request.size;
+            pos = ctx->rwoffset64_request.offset;
+            data = u64_to_user_ptr(ctx->rwoffset64_request.data);
+            zcopy = ctx->rwoffset64_request.flags & KMOD_RW_ZCOPY;
+            
+            // Reject anything that falls outside the device
+            if (!kmod_dev_range_ok(pos, size64)) {
+                printk(KERN_ERR "Request outside device (size %lld)\n", kmod_dev_size());
+                return -EINVAL;
             }
             
-            vfree(kernbuf);
-            current_offset = pos;  // Update the current offset
-            printk(KERN_INFO "WRITEOFFSET completed: wrote %zd bytes, new offset=%lu\n", bytes, current_offset);
+            op = (cmd == BREADOFFSET64) ? KMOD_STAT_READOFFSET : KMOD_STAT_WRITEOFFSET;
+            start = kmod_stats_submit(op, pos, size64);
+            if (cmd == BREADOFFSET64)
+                bytes = kmod_read_user(data, size64, &pos, zcopy, NULL);
+            else
+                bytes = kmod_write_user(data, size64, &pos, zcopy);
+            kmod_stats_complete(op, size64, bytes, start);
+            if (bytes < 0)
+                return bytes;
+            
+            ctx->current_offset = pos;  // Update the current offset
             return bytes;
             
         default: 
@@ -219,22 +379,154 @@ static long kmod_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
     return 0;
 }
 
+/* BDISCARD/BWRITEZEROES: the range never crosses the user boundary */
+static long kmod_range_op(void __user *arg, bool zero) {
+    enum kmod_stat_op op = zero ? KMOD_STAT_WRITEZEROES : KMOD_STAT_DISCARD;
+    struct block_range_ops range;
+    u64 start;
+    int ret;
+    
+    if (copy_from_user(&range, arg, sizeof(range)))
+        return -EFAULT;
+    
+    start = kmod_stats_submit(op, range.offset, range.size);
+    if (zero)
+        ret = kmod_dev_write_zeroes(range.offset, range.size);
+    else
+        ret = kmod_dev_discard(range.offset, range.size);
+    kmod_stats_complete(op, range.size, ret ? ret : range.size, start);
+    
+    return ret;
+}
+
+/* BCOPY: both ends of the copy stay in the kernel */
+static long kmod_copy(void __user *arg) {
+    struct block_copy_ops copy;
+    ssize_t bytes;
+    u64 start;
+    
+    if (copy_from_user(&copy, arg, sizeof(copy)))
+        return -EFAULT;
+    
+    start = kmod_stats_submit(KMOD_STAT_COPY, copy.dst, copy.size);
+    bytes = kmod_dev_copy(copy.src, copy.dst, copy.size,
+                          !(copy.flags & KMOD_COPY_NO_OFFLOAD));
+    kmod_stats_complete(KMOD_STAT_COPY, copy.size, bytes, start);
+    
+    return bytes;
+}
+
+static long kmod_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
+    struct kmod_file *ctx = f->private_data;
+    struct kmod_cache_stats cache_stats;
+    struct kmod_ring *ring;
+    long ret;
+    
+    switch (cmd)
+    {
+        case BREADV:
+            return kmod_vec_rw((void __user *)arg, false);
+            
+        case BWRITEV:
+            return kmod_vec_rw((void __user *)arg, true);
+            
+        case BRINGSETUP:
+            ring = kmod_ring_setup((void __user *)arg);
+            if (IS_ERR(ring))
+                return PTR_ERR(ring);
+            
+            // Only one ring per open file
+            if (cmpxchg(&ctx->ring, NULL, ring)) {
+                kmod_ring_destroy(ring);
+                return -EBUSY;
+            }
+            return 0;
+            
+        case BRINGENTER:
+            return kmod_ring_enter(READ_ONCE(ctx->ring), (void __user *)arg);
+            
+        case BRINGSUBMIT:
+            return kmod_ring_submit(READ_ONCE(ctx->ring), (void __user *)arg);
+            
+        case BRINGEVENTFD:
+            return kmod_ring_set_eventfd(READ_ONCE(ctx->ring), (void __user *)arg);
+            
+        case BFLUSH:
+            // Push out coalesced writes, then make everything durable
+            ret = kmod_wbuf_flush(&ctx->wbuf_since);
+            if (!ret)
+                ret = kmod_dev_sync();
+            return ret;
+            
+        case BDISCARD:
+            return kmod_range_op((void __user *)arg, false);
+            
+        case BWRITEZEROES:
+            return kmod_range_op((void __user *)arg, true);
+            
+        case BCOPY:
+            return kmod_copy((void __user *)arg);
+            
+        case BCACHESTATS:
+            kmod_cache_get_stats(&cache_stats);
+            if (copy_to_user((void __user *)arg, &cache_stats, sizeof(cache_stats)))
+                return -EFAULT;
+            return 0;
+            
+        default:
+            mutex_lock(&ctx->lock);
+            ret = kmod_ioctl_rw(ctx, cmd, arg);
+            mutex_unlock(&ctx->lock);
+            return ret;
+    }
+}
+
 static int kmod_open(struct inode* inode, struct file* file) {
+    struct kmod_file *ctx;
+    
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return -ENOMEM;
+    
+    mutex_init(&ctx->lock);
+    ctx->wbuf_since = kmod_wbuf_sample();
+    file->private_data = ctx;
     printk("Opened kmod. \n");
     return 0;
 }
 
 static int kmod_release(struct inode* inode, struct file* file) {
+    struct kmod_file *ctx = file->private_data;
+    
+    kmod_ring_destroy(ctx->ring);
+    if (kmod_wbuf_flush(&ctx->wbuf_since))
+        printk(KERN_ERR "Buffered writes failed before close\n");
+    mutex_destroy(&ctx->lock);
+    kfree(ctx);
     printk("Closed kmod. \n");
     return 0;
 }
 
+static int kmod_mmap(struct file* file, struct vm_area_struct* vma) {
+    struct kmod_file *ctx = file->private_data;
+    
+    return kmod_ring_mmap(READ_ONCE(ctx->ring), vma);
+}
+
+static __poll_t kmod_poll(struct file* file, poll_table* wait) {
+    struct kmod_file *ctx = file->private_data;
+    
+    return kmod_ring_poll(READ_ONCE(ctx->ring), file, wait);
+}
+
 static struct file_operations fops = 
 {
     .owner          = THIS_MODULE,
     .open           = kmod_open,
     .release        = kmod_release,
     .unlocked_ioctl = kmod_ioctl,
+    .mmap           = kmod_mmap,
+    .poll           = kmod_poll,
 };
 
 /* Initialize the module for IOCTL commands */
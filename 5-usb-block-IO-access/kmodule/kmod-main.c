@@ -16,6 +16,9 @@
 #include <linux/version.h>
 #include <linux/blkpg.h>     
 #include <linux/namei.h>     
+#include <linux/overflow.h>
+
+#include "kmod-common.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Adil Ahmad");
@@ -26,25 +29,212 @@ MODULE_VERSION("1.0");
 char* device = "/dev/sdb";
 module_param(device, charp, S_IRUGO);
 
+/*
+ * I/O engine: "buffered" goes through the page cache, "bio" submits bios
+ * directly, "ram" serves everything from memory without opening a device
+ */
+char* engine = "buffered";
+module_param(engine, charp, S_IRUGO);
+
 /* USB storage disk-related data structures - important: not static */
 struct file *usb_file = NULL;
 EXPORT_SYMBOL(usb_file); // Export this symbol for use in other files
 
+/* RAID-0 member devices, striped when more than one is given */
+static char *devices[KMOD_MAX_MEMBERS];
+static int nr_devices;
+module_param_array(devices, charp, &nr_devices, S_IRUGO);
+
+/* Set when the device was opened for the direct bio engine */
+static bool use_bio = false;
+
 bool kmod_ioctl_init(void);
 void kmod_ioctl_teardown(void);
 
-static bool open_usb(void)
+/* I/O on one opened device, routed to the engine picked at load time */
+ssize_t kmod_file_rw(struct file *file, void *buf, size_t size, loff_t *pos, bool write)
 {
-    /* Open a file for the path of the usb */
-    printk(KERN_INFO "Opening USB device: %s\n", device);
+    if (use_bio)
+        return kmod_bio_rw(file, buf, size, pos, write);
+    if (write)
+        return kernel_write(file, buf, size, pos);
+    return kernel_read(file, buf, size, pos);
+}
+
+/* Backend I/O on kernel buffers: RAM, the striped members or the one device */
+ssize_t kmod_dev_backend_rw(void *buf, size_t size, loff_t *pos, bool write)
+{
+    if (kmod_ram_enabled())
+        return kmod_ram_rw(buf, size, pos, write);
+    if (kmod_stripe_enabled())
+        return kmod_stripe_rw(buf, size, pos, write);
+    return kmod_file_rw(usb_file, buf, size, pos, write);
+}
+
+/* Raw device I/O on kernel buffers, checksummed in integrity mode */
+ssize_t kmod_dev_raw_read(void *buf, size_t size, loff_t *pos)
+{
+    loff_t start = *pos;
+    ssize_t bytes;
+    int err;
     
-    usb_file = filp_open(device, O_RDWR, 0);
-    if (IS_ERR(usb_file)) {
+    // Keep writes to the blocks out until their CRCs have been checked
+    kmod_integrity_lock(start, size, false);
+    bytes = kmod_dev_backend_rw(buf, size, pos, false);
+    if (bytes > 0 && kmod_integrity_enabled()) {
+        err = kmod_integrity_verify(buf, bytes, start);
+        if (err)
+            bytes = err;
+    }
+    kmod_integrity_unlock(start, size, false);
+    return bytes;
+}
+
+ssize_t kmod_dev_raw_write(const void *buf, size_t size, loff_t *pos)
+{
+    loff_t start = *pos;
+    ssize_t bytes;
+    
+    kmod_integrity_lock(start, size, true);
+    bytes = kmod_dev_backend_rw((void *)buf, size, pos, true);
+    if (bytes > 0 && kmod_integrity_enabled())
+        kmod_integrity_update(buf, bytes, start);
+    kmod_integrity_unlock(start, size, true);
+    return bytes;
+}
+
+/* Device I/O as seen by requests, with pending buffered writes applied */
+ssize_t kmod_dev_read(void *buf, size_t size, loff_t *pos)
+{
+    if (kmod_wbuf_enabled())
+        return kmod_wbuf_read(buf, size, pos);
+    return kmod_dev_raw_read(buf, size, pos);
+}
+
+ssize_t kmod_dev_write(const void *buf, size_t size, loff_t *pos)
+{
+    loff_t start = *pos;
+    ssize_t bytes;
+    
+    if (kmod_wbuf_enabled())
+        bytes = kmod_wbuf_write(buf, size, pos);
+    else
+        bytes = kmod_dev_raw_write(buf, size, pos);
+    
+    /* Cached blocks overlapping the write are stale now */
+    kmod_cache_invalidate(start, size);
+    return bytes;
+}
+
+/* Size of one opened device in bytes */
+loff_t kmod_file_size(struct file *file)
+{
+    if (S_ISBLK(file_inode(file)->i_mode))
+        return bdev_nr_bytes(file_bdev(file));
+    return i_size_read(file_inode(file));
+}
+
+/* Smallest I/O one opened device accepts */
+unsigned int kmod_file_block_size(struct file *file)
+{
+    if (S_ISBLK(file_inode(file)->i_mode))
+        return bdev_logical_block_size(file_bdev(file));
+    return SECTOR_SIZE;
+}
+
+/* Size of the logical device in bytes */
+loff_t kmod_dev_size(void)
+{
+    if (kmod_ram_enabled())
+        return kmod_ram_size();
+    if (kmod_stripe_enabled())
+        return kmod_stripe_size();
+    return kmod_file_size(usb_file);
+}
+
+unsigned int kmod_dev_block_size(void)
+{
+    if (kmod_ram_enabled())
+        return SECTOR_SIZE;
+    if (kmod_stripe_enabled())
+        return kmod_stripe_block_size();
+    return kmod_file_block_size(usb_file);
+}
+
+/* Push written data out to the media of every device */
+int kmod_dev_sync(void)
+{
+    if (kmod_ram_enabled())
+        return 0;
+    if (kmod_stripe_enabled())
+        return kmod_stripe_sync();
+    return vfs_fsync(usb_file, 0);
+}
+
+/* Check that [pos, pos + size) lies within the device */
+bool kmod_dev_range_ok(loff_t pos, u64 size)
+{
+    u64 end;
+    
+    if (pos < 0 || check_add_overflow((u64)pos, size, &end))
+        return false;
+    return end <= (u64)kmod_dev_size();
+}
+
+/* Open one device with the selected engine */
+struct file *kmod_dev_open(const char *path)
+{
+    struct file *file;
+    
+    if (use_bio)
+        file = bdev_file_open_by_path(path, BLK_OPEN_READ | BLK_OPEN_WRITE, NULL, NULL);
+    else
+        file = filp_open(path, O_RDWR, 0);
+    
+    if (IS_ERR(file))
         printk(KERN_ERR "Failed to open device file %s, error: %ld\n", 
-               device, PTR_ERR(usb_file));
+               path, PTR_ERR(file));
+    return file;
+}
+
+void kmod_dev_close(struct file *file)
+{
+    if (use_bio)
+        fput(file);
+    else
+        filp_close(file, NULL);
+}
+
+static bool open_usb(void)
+{
+    if (!strcmp(engine, "ram")) {
+        printk(KERN_INFO "Using RAM backend instead of %s\n", device);
+        return kmod_ram_open();
+    } else if (!strcmp(engine, "bio")) {
+        use_bio = true;
+    } else if (strcmp(engine, "buffered")) {
+        printk(KERN_ERR "Unknown engine %s\n", engine);
         return false;
     }
     
+    /* Several devices are striped, the first one stands in as usb_file */
+    if (nr_devices > 1) {
+        printk(KERN_INFO "Opening %d striped devices (engine=%s)\n", nr_devices, engine);
+        if (!kmod_stripe_open(devices, nr_devices))
+            return false;
+        usb_file = kmod_stripe_file(0);
+        return true;
+    }
+    
+    if (nr_devices == 1)
+        device = devices[0];
+    
+    /* Open a file for the path of the usb */
+    printk(KERN_INFO "Opening USB device: %s (engine=%s)\n", device, engine);
+    usb_file = kmod_dev_open(device);
+    if (IS_ERR(usb_file))
+        return false;
+    
     printk(KERN_INFO "Successfully opened USB device: %s\n", device);
     return true;
 }
@@ -52,8 +242,13 @@ static bool open_usb(void)
 static void close_usb(void)
 {
     /* Close the file and device communication interface */
-    if (usb_file && !IS_ERR(usb_file)) {
-        filp_close(usb_file, NULL);
+    if (kmod_ram_enabled()) {
+        kmod_ram_close();
+    } else if (kmod_stripe_enabled()) {
+        kmod_stripe_close();
+        usb_file = NULL;
+    } else if (usb_file && !IS_ERR(usb_file)) {
+        kmod_dev_close(usb_file);
         usb_file = NULL;
         printk(KERN_INFO "Closed device file\n");
     }
@@ -69,7 +264,91 @@ static int __init kmod_init(void)
         return -ENODEV;
     }
     
+    if (!kmod_pool_init()) {
+        close_usb();
+        pr_err("Failed to initialize buffer pool\n");
+        return -ENOMEM;
+    }
+    
+    if (!kmod_integrity_init()) {
+        kmod_pool_teardown();
+        close_usb();
+        pr_err("Failed to initialize integrity checking\n");
+        return -EINVAL;
+    }
+    
+    if (!kmod_cache_init()) {
+        kmod_integrity_teardown();
+        kmod_pool_teardown();
+        close_usb();
+        pr_err("Failed to initialize block cache\n");
+        return -ENOMEM;
+    }
+    
+    if (!kmod_wbuf_init()) {
+        kmod_cache_teardown();
+        kmod_integrity_teardown();
+        kmod_pool_teardown();
+        close_usb();
+        pr_err("Failed to initialize write buffer\n");
+        return -ENOMEM;
+    }
+    
+    if (!kmod_chunk_init()) {
+        kmod_wbuf_teardown();
+        kmod_cache_teardown();
+        kmod_integrity_teardown();
+        kmod_pool_teardown();
+        close_usb();
+        pr_err("Failed to initialize chunk buffers\n");
+        return -ENOMEM;
+    }
+    
+    if (!kmod_workers_init()) {
+        kmod_chunk_teardown();
+        kmod_wbuf_teardown();
+        kmod_cache_teardown();
+        kmod_integrity_teardown();
+        kmod_pool_teardown();
+        close_usb();
+        pr_err("Failed to start worker threads\n");
+        return -ENOMEM;
+    }
+    
+    if (!kmod_stats_init()) {
+        kmod_workers_teardown();
+        kmod_chunk_teardown();
+        kmod_wbuf_teardown();
+        kmod_cache_teardown();
+        kmod_integrity_teardown();
+        kmod_pool_teardown();
+        close_usb();
+        pr_err("Failed to initialize statistics\n");
+        return -ENOMEM;
+    }
+    
+    if (!kmod_blk_init()) {
+        kmod_stats_teardown();
+        kmod_workers_teardown();
+        kmod_chunk_teardown();
+        kmod_wbuf_teardown();
+        kmod_cache_teardown();
+        kmod_integrity_teardown();
+        kmod_pool_teardown();
+        close_usb();
+        pr_err("Failed to register block device\n");
+        return -ENODEV;
+    }
+    
     if (!kmod_ioctl_init()) {
+        kmod_blk_teardown();
+        kmod_stats_teardown();
+        kmod_workers_teardown();
+        kmod_chunk_teardown();
+        kmod_wbuf_teardown();
+        kmod_cache_teardown();
+        kmod_integrity_teardown();
+        kmod_pool_teardown();
         close_usb();
         pr_err("Failed to initialize IOCTL interface\n");
         return -EFAULT;
@@ -81,8 +360,16 @@ static int __init kmod_init(void)
 
 static void __exit kmod_fini(void)
 {
+    kmod_stats_teardown();
+    kmod_blk_teardown();
+    kmod_workers_teardown();
+    kmod_chunk_teardown();
+    kmod_wbuf_teardown();
+    kmod_cache_teardown();
+    kmod_integrity_teardown();
     close_usb();
     kmod_ioctl_teardown();
+    kmod_pool_teardown();
     printk("Block IO Kernel Module unloaded\n");
 }
 
@@ -0,0 +1,255 @@
+#include <linux/math64.h>
+#include <linux/minmax.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "kmod-common.h"
+
+/*
+ * Size-classed buffer pool for per-request kernel buffers: bounce buffers,
+ * cache blocks, pinned page arrays and vectored request state. Buffers up
+ * to 64 KiB come from small per-CPU stacks that need no locking, larger
+ * ones up to 1 MiB from a shared stack per class. When a stack runs dry
+ * the buffer is allocated on demand at the class size, and on free it goes
+ * back to the stack if there is room, so the pool fills up as it is used
+ * and refills itself after a burst. Anything above 1 MiB is always
+ * allocated on demand.
+ *
+ * The stacks start empty. Full stacks hold pool_depth * 84 KiB per CPU plus
+ * pool_large * 1.25 MiB shared, 336 KiB per CPU and 5 MiB with the
+ * defaults, which only a module that has seen that much concurrency pays
+ * for. pool_prefill=1 allocates all of it at load time instead, so the
+ * first requests hit the pool too.
+ */
+
+#define KMOD_POOL_SMALL_CLASSES 3
+#define KMOD_POOL_CLASSES       5
+#define KMOD_POOL_MAX_DEPTH     16
+
+static const size_t kmod_pool_sizes[KMOD_POOL_CLASSES] = {
+    SZ_4K, SZ_16K, SZ_64K, SZ_256K, SZ_1M,
+};
+
+/* Buffers per CPU kept for each class up to 64 KiB */
+static unsigned int pool_depth = 4;
+module_param(pool_depth, uint, S_IRUGO);
+
+/* Shared buffers kept for each of the 256 KiB and 1 MiB classes */
+static unsigned int pool_large = 4;
+module_param(pool_large, uint, S_IRUGO);
+
+/* Fill the stacks at load time rather than as buffers are freed */
+static unsigned int pool_prefill = 0;
+module_param(pool_prefill, uint, S_IRUGO);
+
+struct kmod_pool_cpu {
+    unsigned int    nr[KMOD_POOL_SMALL_CLASSES];
+    void            *bufs[KMOD_POOL_SMALL_CLASSES][KMOD_POOL_MAX_DEPTH];
+
+    /* Last slot counts requests too big for any class */
+    u64             hits[KMOD_POOL_CLASSES + 1];
+    u64             misses[KMOD_POOL_CLASSES + 1];
+};
+
+struct kmod_pool_shared {
+    spinlock_t      lock;
+    unsigned int    nr;
+    void            **bufs;
+};
+
+static struct kmod_pool_cpu __percpu *pool_cpu;
+static struct kmod_pool_shared pool_shared[KMOD_POOL_CLASSES - KMOD_POOL_SMALL_CLASSES];
+
+static int kmod_pool_class(size_t size) {
+    int cls;
+
+    for (cls = 0; cls < KMOD_POOL_CLASSES; cls++)
+        if (size <= kmod_pool_sizes[cls])
+            return cls;
+    return -1;
+}
+
+void *kmod_pool_alloc(size_t size) {
+    int cls = kmod_pool_class(size);
+    void *buf = NULL;
+
+    if (cls < 0) {
+        this_cpu_inc(pool_cpu->misses[KMOD_POOL_CLASSES]);
+        return kvmalloc(size, GFP_KERNEL);
+    }
+
+    if (cls < KMOD_POOL_SMALL_CLASSES) {
+        struct kmod_pool_cpu *pc = get_cpu_ptr(pool_cpu);
+
+        if (pc->nr[cls])
+            buf = pc->bufs[cls][--pc->nr[cls]];
+        put_cpu_ptr(pool_cpu);
+    } else {
+        struct kmod_pool_shared *ps = &pool_shared[cls - KMOD_POOL_SMALL_CLASSES];
+
+        spin_lock(&ps->lock);
+        if (ps->nr)
+            buf = ps->bufs[--ps->nr];
+        spin_unlock(&ps->lock);
+    }
+
+    if (buf) {
+        this_cpu_inc(pool_cpu->hits[cls]);
+        return buf;
+    }
+
+    /* Allocate at the class size so the buffer can join the pool on free */
+    this_cpu_inc(pool_cpu->misses[cls]);
+    return kvmalloc(kmod_pool_sizes[cls], GFP_KERNEL);
+}
+
+void kmod_pool_free(void *buf, size_t size) {
+    int cls = kmod_pool_class(size);
+
+    if (!buf)
+        return;
+
+    if (cls >= 0 && cls < KMOD_POOL_SMALL_CLASSES) {
+        struct kmod_pool_cpu *pc = get_cpu_ptr(pool_cpu);
+
+        if (pc->nr[cls] < pool_depth) {
+            pc->bufs[cls][pc->nr[cls]++] = buf;
+            buf = NULL;
+        }
+        put_cpu_ptr(pool_cpu);
+    } else if (cls >= 0) {
+        struct kmod_pool_shared *ps = &pool_shared[cls - KMOD_POOL_SMALL_CLASSES];
+
+        spin_lock(&ps->lock);
+        if (ps->nr < pool_large) {
+            ps->bufs[ps->nr++] = buf;
+            buf = NULL;
+        }
+        spin_unlock(&ps->lock);
+    }
+
+    kvfree(buf);
+}
+
+void kmod_pool_show(struct seq_file *m) {
+    u64 hits, misses;
+    unsigned int nr;
+    int cls, cpu;
+
+    seq_printf(m, "%-10s %14s %14s %6s %6s\n", "class", "hits", "misses", "hit%", "free");
+    for (cls = 0; cls <= KMOD_POOL_CLASSES; cls++) {
+        hits = misses = 0;
+        nr = 0;
+
+        for_each_possible_cpu(cpu) {
+            struct kmod_pool_cpu *pc = per_cpu_ptr(pool_cpu, cpu);
+
+            hits += pc->hits[cls];
+            misses += pc->misses[cls];
+            if (cls < KMOD_POOL_SMALL_CLASSES)
+                nr += READ_ONCE(pc->nr[cls]);
+        }
+        if (cls >= KMOD_POOL_SMALL_CLASSES && cls < KMOD_POOL_CLASSES)
+            nr = READ_ONCE(pool_shared[cls - KMOD_POOL_SMALL_CLASSES].nr);
+
+        if (cls < KMOD_POOL_CLASSES)
+            seq_printf(m, "%-10zu", kmod_pool_sizes[cls]);
+        else
+            seq_printf(m, "%-10s", "oversize");
+        seq_printf(m, " %14llu %14llu %6llu %6u\n", hits, misses,
+                   hits + misses ? div64_u64(hits * 100, hits + misses) : 0, nr);
+    }
+}
+
+void kmod_pool_teardown(void) {
+    unsigned int i;
+    int cls, cpu;
+
+    for (cls = 0; cls < KMOD_POOL_CLASSES - KMOD_POOL_SMALL_CLASSES; cls++) {
+        struct kmod_pool_shared *ps = &pool_shared[cls];
+
+        for (i = 0; i < ps->nr; i++)
+            kvfree(ps->bufs[i]);
+        kfree(ps->bufs);
+        ps->bufs = NULL;
+        ps->nr = 0;
+    }
+
+    if (!pool_cpu)
+        return;
+
+    for_each_possible_cpu(cpu) {
+        struct kmod_pool_cpu *pc = per_cpu_ptr(pool_cpu, cpu);
+
+        for (cls = 0; cls < KMOD_POOL_SMALL_CLASSES; cls++)
+            for (i = 0; i < pc->nr[cls]; i++)
+                kvfree(pc->bufs[cls][i]);
+    }
+    free_percpu(pool_cpu);
+    pool_cpu = NULL;
+}
+
+bool kmod_pool_init(void) {
+    unsigned int i;
+    int cls, cpu;
+
+    pool_depth = min_t(unsigned int, pool_depth, KMOD_POOL_MAX_DEPTH);
+
+    pool_cpu = alloc_percpu(struct kmod_pool_cpu);
+    if (!pool_cpu)
+        return false;
+
+    for (cls = 0; cls < KMOD_POOL_CLASSES - KMOD_POOL_SMALL_CLASSES; cls++) {
+        struct kmod_pool_shared *ps = &pool_shared[cls];
+
+        spin_lock_init(&ps->lock);
+        if (!pool_large)
+            continue;
+
+        ps->bufs = kcalloc(pool_large, sizeof(*ps->bufs), GFP_KERNEL);
+        if (!ps->bufs)
+            goto fail;
+    }
+
+    if (!pool_prefill)
+        goto out;
+
+    for_each_possible_cpu(cpu) {
+        struct kmod_pool_cpu *pc = per_cpu_ptr(pool_cpu, cpu);
+
+        for (cls = 0; cls < KMOD_POOL_SMALL_CLASSES; cls++) {
+            for (i = 0; i < pool_depth; i++) {
+                pc->bufs[cls][i] = kvmalloc_node(kmod_pool_sizes[cls], GFP_KERNEL,
+                                                 cpu_to_node(cpu));
+                if (!pc->bufs[cls][i])
+                    goto fail;
+                pc->nr[cls]++;
+            }
+        }
+    }
+
+    for (cls = 0; cls < KMOD_POOL_CLASSES - KMOD_POOL_SMALL_CLASSES; cls++) {
+        struct kmod_pool_shared *ps = &pool_shared[cls];
+
+        for (i = 0; i < pool_large; i++) {
+            ps->bufs[i] = kvmalloc(kmod_pool_sizes[cls + KMOD_POOL_SMALL_CLASSES], GFP_KERNEL);
+            if (!ps->bufs[i])
+                goto fail;
+            ps->nr++;
+        }
+    }
+
+out:
+    printk(KERN_INFO "Buffer pool: %u per-CPU buffers per small class, %u shared per large class (%s)\n",
+           pool_depth, pool_large, pool_prefill ? "prefilled" : "filled on use");
+    return true;
+
+fail:
+    kmod_pool_teardown();
+    return false;
+}
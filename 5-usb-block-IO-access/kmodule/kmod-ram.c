@@ -0,0 +1,186 @@
+#include <linux/atomic.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/minmax.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/xarray.h>
+
+#include "kmod-common.h"
+
+/*
+ * RAM backend for engine=ram: the device is a sparse xarray of pages
+ * indexed by page offset, ram_mb in size, and no USB device is opened.
+ * Pages are allocated on first write and read back as zeroes until then,
+ * so benchmarks see the cost of the ioctl path itself (copies, allocation,
+ * locking) without device variance. Page copies run under the RCU read
+ * lock and discarded pages are only freed after a grace period, so a
+ * discard can never pull a page out from under a copy.
+ */
+
+/* Size of the RAM device in MiB */
+static unsigned int ram_mb = 1024;
+module_param(ram_mb, uint, S_IRUGO);
+
+static DEFINE_XARRAY(ram_pages);
+static atomic_long_t ram_nr_pages = ATOMIC_LONG_INIT(0);
+static loff_t ram_size;
+static bool ram_enabled;
+
+bool kmod_ram_enabled(void) {
+    return ram_enabled;
+}
+
+loff_t kmod_ram_size(void) {
+    return ram_size;
+}
+
+/* Back index with a zeroed page, losing a race to another writer is fine */
+static int kmod_ram_alloc_page(pgoff_t index) {
+    struct page *page, *old;
+
+    page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
+    if (!page)
+        return -ENOMEM;
+
+    old = xa_cmpxchg(&ram_pages, index, NULL, page, GFP_NOIO);
+    if (xa_is_err(old)) {
+        __free_page(page);
+        return xa_err(old);
+    }
+    if (old)
+        __free_page(page);
+    else
+        atomic_long_inc(&ram_nr_pages);
+    return 0;
+}
+
+ssize_t kmod_ram_rw(void *buf, size_t size, loff_t *pos, bool write) {
+    size_t done = 0;
+    int err = 0;
+
+    /* Same end-of-device behaviour as a block device */
+    if (*pos >= ram_size)
+        return write ? -ENOSPC : 0;
+    if (*pos + size > ram_size) {
+        if (write)
+            return -ENOSPC;
+        size = ram_size - *pos;
+    }
+
+    while (done < size) {
+        loff_t off = *pos + done;
+        unsigned int poff = offset_in_page(off);
+        size_t len = min_t(size_t, size - done, PAGE_SIZE - poff);
+        struct page *page;
+        char *addr;
+
+        rcu_read_lock();
+        page = xa_load(&ram_pages, off >> PAGE_SHIFT);
+        if (page) {
+            addr = kmap_local_page(page);
+            if (write)
+                memcpy(addr + poff, buf + done, len);
+            else
+                memcpy(buf + done, addr + poff, len);
+            kunmap_local(addr);
+        } else if (!write) {
+            memset(buf + done, 0, len);
+        }
+        rcu_read_unlock();
+
+        /* First write to this page: back it and go round again */
+        if (!page && write) {
+            err = kmod_ram_alloc_page(off >> PAGE_SHIFT);
+            if (err)
+                break;
+            continue;
+        }
+        done += len;
+    }
+
+    if (!done)
+        return err;
+
+    *pos += done;
+    return done;
+}
+
+/* Free every page in [first, last] once no copy can still be using them */
+static void kmod_ram_free_pages(pgoff_t first, pgoff_t last) {
+    struct page *page, *tmp;
+    LIST_HEAD(freed);
+    unsigned long index;
+
+    xa_for_each_range(&ram_pages, index, page, first, last) {
+        xa_erase(&ram_pages, index);
+        list_add(&page->lru, &freed);
+        atomic_long_dec(&ram_nr_pages);
+    }
+    if (list_empty(&freed))
+        return;
+
+    synchronize_rcu();
+    list_for_each_entry_safe(page, tmp, &freed, lru)
+        __free_page(page);
+}
+
+/* Zero part of one page, absent pages already read as zero */
+static void kmod_ram_zero(loff_t pos, size_t len) {
+    struct page *page;
+
+    rcu_read_lock();
+    page = xa_load(&ram_pages, pos >> PAGE_SHIFT);
+    if (page)
+        memzero_page(page, offset_in_page(pos), len);
+    rcu_read_unlock();
+}
+
+/* Discard and write-zeroes are the same thing here: fewer pages, read as zero */
+int kmod_ram_discard(loff_t pos, u64 len) {
+    loff_t end = pos + len;
+    pgoff_t first = DIV_ROUND_UP(pos, PAGE_SIZE), last = end >> PAGE_SHIFT;
+
+    /* Partial pages at either end are zeroed in place */
+    if (offset_in_page(pos))
+        kmod_ram_zero(pos, min_t(u64, len, PAGE_SIZE - offset_in_page(pos)));
+    if (offset_in_page(end) && last >= first)
+        kmod_ram_zero(round_down(end, PAGE_SIZE), offset_in_page(end));
+
+    if (last > first)
+        kmod_ram_free_pages(first, last - 1);
+    return 0;
+}
+
+void kmod_ram_show(struct seq_file *m) {
+    long nr = atomic_long_read(&ram_nr_pages);
+
+    seq_printf(m, "size %lld\npages %ld\nbytes %lld\n", ram_size, nr, (loff_t)nr << PAGE_SHIFT);
+}
+
+void kmod_ram_close(void) {
+    if (!ram_enabled)
+        return;
+
+    kmod_ram_free_pages(0, ULONG_MAX);
+    xa_destroy(&ram_pages);
+    ram_enabled = false;
+    printk(KERN_INFO "RAM device released\n");
+}
+
+bool kmod_ram_open(void) {
+    if (!ram_mb) {
+        printk(KERN_ERR "ram_mb must be set for engine=ram\n");
+        return false;
+    }
+
+    ram_size = (loff_t)ram_mb << 20;
+    ram_enabled = true;
+    printk(KERN_INFO "RAM device: %u MiB, allocated on first write\n", ram_mb);
+    return true;
+}
@@ -0,0 +1,375 @@
+#include <linux/err.h>
+#include <linux/eventfd.h>
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "../ioctl-defines-ext.h"
+#include "kmod-common.h"
+
+/*
+ * Shared-memory submission/completion rings for /dev/kmod, modeled on
+ * io_uring. Each open file can set up one ring, which gets its own worker
+ * thread that drains the SQ in the context of the owning process's mm and
+ * posts results to the CQ. The worker keeps polling for ring_idle_us after
+ * the last SQE before it goes to sleep and asks for a BRINGENTER wakeup.
+ *
+ * Event loops don't have to block in BRINGENTER: /dev/kmod polls readable
+ * while the CQ holds completions and writable while the SQ has room, and
+ * an eventfd registered with BRINGEVENTFD is signaled for every CQE.
+ * BRINGSUBMIT queues one SQE without touching the shared SQ, for callers
+ * that only mmap the ring to read completions.
+ */
+
+/* How long the ring worker polls for new SQEs before sleeping */
+static unsigned int ring_idle_us = 1000;
+module_param(ring_idle_us, uint, S_IRUGO | S_IWUSR);
+
+struct kmod_ring {
+    /* Shared with userspace */
+    void                    *mem;
+    size_t                  size;
+    struct kmod_ring_hdr    *hdr;
+    struct kmod_sqe         *sqes;
+    struct kmod_cqe         *cqes;
+
+    /* Kernel-private copies, never trusted from the shared header */
+    unsigned int            sq_entries;
+    unsigned int            cq_entries;
+    unsigned int            sq_head;
+    unsigned int            cq_tail;
+
+    struct mm_struct        *mm;
+    struct task_struct      *worker;
+    wait_queue_head_t       sq_wait;
+    wait_queue_head_t       cq_wait;
+
+    /* Serializes BRINGSUBMIT producers */
+    struct mutex            submit_lock;
+
+    /* Signaled for every CQE, set by BRINGEVENTFD */
+    struct eventfd_ctx __rcu *evfd;
+};
+
+static unsigned int kmod_ring_sq_pending(struct kmod_ring *ring) {
+    unsigned int pending = smp_load_acquire(&ring->hdr->sq_tail) - ring->sq_head;
+
+    /* A bogus tail from userspace can't make us run past the ring */
+    return min(pending, ring->sq_entries);
+}
+
+/* CQEs not yet reaped, a cq_head from userspace that makes no sense reads as a full CQ */
+static unsigned int kmod_ring_cq_ready(struct kmod_ring *ring) {
+    unsigned int ready = ring->cq_tail - READ_ONCE(ring->hdr->cq_head);
+
+    return min(ready, ring->cq_entries);
+}
+
+static bool kmod_ring_cq_room(struct kmod_ring *ring) {
+    return kmod_ring_cq_ready(ring) < ring->cq_entries;
+}
+
+static bool kmod_ring_sq_full(struct kmod_ring *ring) {
+    return kmod_ring_sq_pending(ring) >= ring->sq_entries;
+}
+
+/* Tell waiters, pollers and the eventfd about a new CQE */
+static void kmod_ring_notify(struct kmod_ring *ring) {
+    struct eventfd_ctx *evfd;
+
+    wake_up(&ring->cq_wait);
+
+    rcu_read_lock();
+    evfd = rcu_dereference(ring->evfd);
+    if (evfd)
+        eventfd_signal(evfd);
+    rcu_read_unlock();
+}
+
+static ssize_t kmod_ring_execute(struct kmod_sqe *sqe) {
+    loff_t pos = sqe->op.offset;
+    bool zcopy = sqe->flags & KMOD_SQE_ZCOPY;
+    enum kmod_stat_op op;
+    ssize_t ret;
+    u64 start;
+
+    switch (sqe->opcode) {
+    case KMOD_OP_READ:
+        op = KMOD_STAT_READOFFSET;
+        break;
+    case KMOD_OP_WRITE:
+        op = KMOD_STAT_WRITEOFFSET;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (!kmod_dev_range_ok(pos, sqe->op.size))
+        return -EINVAL;
+
+    start = kmod_stats_submit(op, pos, sqe->op.size);
+    if (op == KMOD_STAT_READOFFSET)
+        ret = kmod_read_user(sqe->op.data, sqe->op.size, &pos, zcopy, NULL);
+    else
+        ret = kmod_write_user(sqe->op.data, sqe->op.size, &pos, zcopy);
+    kmod_stats_complete(op, sqe->op.size, ret, start);
+
+    return ret;
+}
+
+/* Consume as many SQEs as the CQ has room for, return how many were run */
+static unsigned int kmod_ring_drain(struct kmod_ring *ring) {
+    unsigned int pending, done = 0;
+
+    pending = kmod_ring_sq_pending(ring);
+    if (!pending || !mmget_not_zero(ring->mm))
+        return 0;
+
+    kthread_use_mm(ring->mm);
+    while (pending-- && kmod_ring_cq_room(ring)) {
+        struct kmod_sqe sqe;
+        struct kmod_cqe *cqe;
+
+        /* Take a private copy before handing the slot back */
+        sqe = ring->sqes[ring->sq_head & (ring->sq_entries - 1)];
+        smp_store_release(&ring->hdr->sq_head, ++ring->sq_head);
+
+        cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+        cqe->user_data = sqe.user_data;
+        cqe->res = kmod_ring_execute(&sqe);
+        smp_store_release(&ring->hdr->cq_tail, ++ring->cq_tail);
+
+        kmod_ring_notify(ring);
+        done++;
+    }
+    kthread_unuse_mm(ring->mm);
+    mmput(ring->mm);
+
+    return done;
+}
+
+static int kmod_ring_worker(void *data) {
+    struct kmod_ring *ring = data;
+    unsigned long idle_until = jiffies + usecs_to_jiffies(ring_idle_us);
+
+    while (!kthread_should_stop()) {
+        if (kmod_ring_drain(ring)) {
+            idle_until = jiffies + usecs_to_jiffies(ring_idle_us);
+            continue;
+        }
+
+        if (time_before(jiffies, idle_until)) {
+            cond_resched();
+            continue;
+        }
+
+        /*
+         * Nothing we can do for a while: ask userspace to kick us. With the
+         * CQ full, pending SQEs have to wait until BRINGENTER or poll tells
+         * us userspace has reaped completions.
+         */
+        WRITE_ONCE(ring->hdr->flags, ring->hdr->flags | KMOD_RING_NEED_WAKEUP);
+        smp_mb();
+        wait_event_interruptible(ring->sq_wait,
+                                 (kmod_ring_sq_pending(ring) && kmod_ring_cq_room(ring)) ||
+                                 kthread_should_stop());
+        WRITE_ONCE(ring->hdr->flags, ring->hdr->flags & ~KMOD_RING_NEED_WAKEUP);
+        idle_until = jiffies + usecs_to_jiffies(ring_idle_us);
+    }
+
+    return 0;
+}
+
+struct kmod_ring *kmod_ring_setup(void __user *arg) {
+    struct kmod_ring_params params;
+    struct kmod_ring *ring;
+    size_t sq_off, cq_off;
+
+    if (copy_from_user(&params, arg, sizeof(params)))
+        return ERR_PTR(-EFAULT);
+
+    if (!params.sq_entries || params.sq_entries > KMOD_RING_MAX_ENTRIES ||
+        !is_power_of_2(params.sq_entries))
+        return ERR_PTR(-EINVAL);
+
+    ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+        return ERR_PTR(-ENOMEM);
+
+    ring->sq_entries = params.sq_entries;
+    ring->cq_entries = params.sq_entries * 2;
+
+    sq_off = ALIGN(sizeof(struct kmod_ring_hdr), SMP_CACHE_BYTES);
+    cq_off = ALIGN(sq_off + ring->sq_entries * sizeof(struct kmod_sqe), SMP_CACHE_BYTES);
+    ring->size = PAGE_ALIGN(cq_off + ring->cq_entries * sizeof(struct kmod_cqe));
+
+    ring->mem = vmalloc_user(ring->size);
+    if (!ring->mem) {
+        kfree(ring);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    ring->hdr = ring->mem;
+    ring->sqes = ring->mem + sq_off;
+    ring->cqes = ring->mem + cq_off;
+    ring->hdr->sq_mask = ring->sq_entries - 1;
+    ring->hdr->cq_mask = ring->cq_entries - 1;
+    ring->hdr->sq_off = sq_off;
+    ring->hdr->cq_off = cq_off;
+
+    init_waitqueue_head(&ring->sq_wait);
+    init_waitqueue_head(&ring->cq_wait);
+    mutex_init(&ring->submit_lock);
+
+    /* The worker runs requests against the caller's address space */
+    ring->mm = current->mm;
+    mmgrab(ring->mm);
+
+    ring->worker = kthread_run(kmod_ring_worker, ring, "kmod-ring/%d", task_pid_nr(current));
+    if (IS_ERR(ring->worker)) {
+        long err = PTR_ERR(ring->worker);
+
+        mmdrop(ring->mm);
+        vfree(ring->mem);
+        kfree(ring);
+        return ERR_PTR(err);
+    }
+
+    params.cq_entries = ring->cq_entries;
+    params.ring_size = ring->size;
+    if (copy_to_user(arg, &params, sizeof(params))) {
+        kmod_ring_destroy(ring);
+        return ERR_PTR(-EFAULT);
+    }
+
+    printk(KERN_INFO "Ring setup: %u SQEs, %u CQEs, %zu bytes\n",
+           ring->sq_entries, ring->cq_entries, ring->size);
+    return ring;
+}
+
+long kmod_ring_enter(struct kmod_ring *ring, void __user *arg) {
+    struct kmod_ring_enter enter;
+
+    if (!ring)
+        return -ENXIO;
+
+    if (copy_from_user(&enter, arg, sizeof(enter)))
+        return -EFAULT;
+
+    wake_up(&ring->sq_wait);
+
+    if (enter.min_complete > ring->cq_entries)
+        return -EINVAL;
+
+    if (enter.min_complete &&
+        wait_event_interruptible(ring->cq_wait,
+                                 kmod_ring_cq_ready(ring) >= enter.min_complete))
+        return -ERESTARTSYS;
+
+    return kmod_ring_cq_ready(ring);
+}
+
+/* Queue one SQE on the caller's behalf, never waits for the ring to drain */
+long kmod_ring_submit(struct kmod_ring *ring, void __user *arg) {
+    struct kmod_sqe sqe;
+    unsigned int tail;
+
+    if (!ring)
+        return -ENXIO;
+
+    if (copy_from_user(&sqe, arg, sizeof(sqe)))
+        return -EFAULT;
+
+    mutex_lock(&ring->submit_lock);
+    if (kmod_ring_sq_full(ring)) {
+        mutex_unlock(&ring->submit_lock);
+        return -EAGAIN;
+    }
+    tail = READ_ONCE(ring->hdr->sq_tail);
+    ring->sqes[tail & (ring->sq_entries - 1)] = sqe;
+    smp_store_release(&ring->hdr->sq_tail, tail + 1);
+    mutex_unlock(&ring->submit_lock);
+
+    wake_up(&ring->sq_wait);
+    return 0;
+}
+
+/* Register the eventfd to signal per CQE, a negative fd unregisters it */
+long kmod_ring_set_eventfd(struct kmod_ring *ring, void __user *arg) {
+    struct eventfd_ctx *evfd = NULL, *old;
+    __s32 fd;
+
+    if (!ring)
+        return -ENXIO;
+
+    if (get_user(fd, (__s32 __user *)arg))
+        return -EFAULT;
+
+    if (fd >= 0) {
+        evfd = eventfd_ctx_fdget(fd);
+        if (IS_ERR(evfd))
+            return PTR_ERR(evfd);
+    }
+
+    old = unrcu_pointer(xchg(&ring->evfd, RCU_INITIALIZER(evfd)));
+    if (old) {
+        /* The worker may still be signaling the old one */
+        synchronize_rcu();
+        eventfd_ctx_put(old);
+    }
+    return 0;
+}
+
+__poll_t kmod_ring_poll(struct kmod_ring *ring, struct file *file, poll_table *wait) {
+    __poll_t mask = 0;
+
+    /* Nothing can ever complete without a ring */
+    if (!ring)
+        return EPOLLERR;
+
+    poll_wait(file, &ring->cq_wait, wait);
+
+    /* The caller may have reaped CQEs the worker is waiting for room for */
+    wake_up(&ring->sq_wait);
+
+    if (kmod_ring_cq_ready(ring))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (!kmod_ring_sq_full(ring))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
+int kmod_ring_mmap(struct kmod_ring *ring, struct vm_area_struct *vma) {
+    if (!ring)
+        return -ENXIO;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > ring->size)
+        return -EINVAL;
+
+    return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+void kmod_ring_destroy(struct kmod_ring *ring) {
+    if (!ring)
+        return;
+
+    kthread_stop(ring->worker);
+    if (rcu_access_pointer(ring->evfd))
+        eventfd_ctx_put(rcu_dereference_protected(ring->evfd, true));
+    mutex_destroy(&ring->submit_lock);
+    mmdrop(ring->mm);
+    vfree(ring->mem);
+    kfree(ring);
+}
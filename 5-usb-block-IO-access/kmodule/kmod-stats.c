@@ -0,0 +1,254 @@
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/minmax.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "../ioctl-defines-ext.h"
+#include "kmod-common.h"
+
+#define CREATE_TRACE_POINTS
+#include "kmod-trace.h"
+
+/*
+ * Per-CPU operation counters and log2 latency histograms, broken down by
+ * operation type and log2 request size, exported under /sys/kernel/debug/kmod:
+ *
+ *   stats    - ops, bytes and errors per operation type
+ *   latency  - latency histograms per operation type and size bucket
+ *   cache    - block cache counters
+ *   pool     - buffer pool hits and misses per size class
+ *   blk      - kmodblk0 requests, merged and (approximately) split bios
+ *   members  - per-member ops, bytes and busy time of a striped set
+ *   ram      - pages allocated by the engine=ram backend
+ *   integrity - CRC32C blocks verified, mismatched and updated
+ *   reset    - write anything to zero the counters and histograms
+ *
+ * The kmod:kmod_submit and kmod:kmod_complete tracepoints fire for every
+ * operation regardless of the counters.
+ */
+
+#define KMOD_LAT_BUCKETS        40      /* log2 of latency in ns */
+#define KMOD_SIZE_BUCKETS       12      /* log2 of size, 512 B up to 1 MiB and over */
+#define KMOD_SIZE_MIN_SHIFT     9
+
+struct kmod_cpu_stats {
+    u64 ops[KMOD_NR_STAT_OPS];
+    u64 bytes[KMOD_NR_STAT_OPS];
+    u64 errors[KMOD_NR_STAT_OPS];
+    u64 lat[KMOD_NR_STAT_OPS][KMOD_SIZE_BUCKETS][KMOD_LAT_BUCKETS];
+};
+
+static const char * const kmod_op_names[KMOD_NR_STAT_OPS] = {
+    [KMOD_STAT_READ]        = "READ",
+    [KMOD_STAT_WRITE]       = "WRITE",
+    [KMOD_STAT_READOFFSET]  = "READOFFSET",
+    [KMOD_STAT_WRITEOFFSET] = "WRITEOFFSET",
+    [KMOD_STAT_DISCARD]     = "DISCARD",
+    [KMOD_STAT_WRITEZEROES] = "WRITEZEROES",
+    [KMOD_STAT_COPY]        = "COPY",
+};
+
+static struct kmod_cpu_stats __percpu *kmod_stats;
+static struct dentry *kmod_debugfs;
+
+u64 kmod_stats_submit(enum kmod_stat_op op, loff_t pos, u64 size) {
+    trace_kmod_submit(op, pos, size);
+    return ktime_get_ns();
+}
+
+void kmod_stats_complete(enum kmod_stat_op op, u64 size, ssize_t ret, u64 start) {
+    u64 lat = ktime_get_ns() - start;
+    int sb, lb;
+
+    trace_kmod_complete(op, size, ret, lat);
+
+    sb = clamp_t(int, size ? ilog2(size) : 0, KMOD_SIZE_MIN_SHIFT,
+                 KMOD_SIZE_MIN_SHIFT + KMOD_SIZE_BUCKETS - 1) - KMOD_SIZE_MIN_SHIFT;
+    lb = min_t(int, lat ? ilog2(lat) : 0, KMOD_LAT_BUCKETS - 1);
+
+    this_cpu_inc(kmod_stats->ops[op]);
+    if (ret < 0)
+        this_cpu_inc(kmod_stats->errors[op]);
+    else
+        this_cpu_add(kmod_stats->bytes[op], ret);
+    this_cpu_inc(kmod_stats->lat[op][sb][lb]);
+}
+
+/* Fold every CPU's counters into one snapshot */
+static struct kmod_cpu_stats *kmod_stats_sum(void) {
+    struct kmod_cpu_stats *sum;
+    int cpu, op, sb, lb;
+
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return NULL;
+
+    for_each_possible_cpu(cpu) {
+        struct kmod_cpu_stats *st = per_cpu_ptr(kmod_stats, cpu);
+
+        for (op = 0; op < KMOD_NR_STAT_OPS; op++) {
+            sum->ops[op] += st->ops[op];
+            sum->bytes[op] += st->bytes[op];
+            sum->errors[op] += st->errors[op];
+            for (sb = 0; sb < KMOD_SIZE_BUCKETS; sb++)
+                for (lb = 0; lb < KMOD_LAT_BUCKETS; lb++)
+                    sum->lat[op][sb][lb] += st->lat[op][sb][lb];
+        }
+    }
+
+    return sum;
+}
+
+static int kmod_stats_show(struct seq_file *m, void *v) {
+    struct kmod_cpu_stats *sum = kmod_stats_sum();
+    int op;
+
+    if (!sum)
+        return -ENOMEM;
+
+    seq_printf(m, "%-12s %14s %18s %10s\n", "op", "ops", "bytes", "errors");
+    for (op = 0; op < KMOD_NR_STAT_OPS; op++)
+        seq_printf(m, "%-12s %14llu %18llu %10llu\n", kmod_op_names[op],
+                   sum->ops[op], sum->bytes[op], sum->errors[op]);
+
+    kfree(sum);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kmod_stats);
+
+static void kmod_latency_show_hist(struct seq_file *m, const u64 *hist) {
+    int lb;
+
+    for (lb = 0; lb < KMOD_LAT_BUCKETS; lb++)
+        if (hist[lb])
+            seq_printf(m, "  [%llu, %llu) ns: %llu\n", 1ULL << lb, 1ULL << (lb + 1), hist[lb]);
+}
+
+static int kmod_latency_show(struct seq_file *m, void *v) {
+    struct kmod_cpu_stats *sum = kmod_stats_sum();
+    u64 all[KMOD_LAT_BUCKETS];
+    int op, sb, lb;
+
+    if (!sum)
+        return -ENOMEM;
+
+    for (op = 0; op < KMOD_NR_STAT_OPS; op++) {
+        if (!sum->ops[op])
+            continue;
+
+        memset(all, 0, sizeof(all));
+        for (sb = 0; sb < KMOD_SIZE_BUCKETS; sb++)
+            for (lb = 0; lb < KMOD_LAT_BUCKETS; lb++)
+                all[lb] += sum->lat[op][sb][lb];
+
+        seq_printf(m, "%s size=all\n", kmod_op_names[op]);
+        kmod_latency_show_hist(m, all);
+
+        for (sb = 0; sb < KMOD_SIZE_BUCKETS; sb++) {
+            u64 size = 1ULL << (sb + KMOD_SIZE_MIN_SHIFT);
+            u64 n = 0;
+
+            for (lb = 0; lb < KMOD_LAT_BUCKETS; lb++)
+                n += sum->lat[op][sb][lb];
+            if (!n)
+                continue;
+
+            seq_printf(m, "%s size=%llu%s\n", kmod_op_names[op], size,
+                       sb == KMOD_SIZE_BUCKETS - 1 ? "+" : "");
+            kmod_latency_show_hist(m, sum->lat[op][sb]);
+        }
+    }
+
+    kfree(sum);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kmod_latency);
+
+static int kmod_cache_show(struct seq_file *m, void *v) {
+    struct kmod_cache_stats cs;
+
+    kmod_cache_get_stats(&cs);
+    seq_printf(m, "hits %llu\nmisses %llu\nra_issued %llu\nra_hits %llu\nevictions %llu\n",
+               cs.hits, cs.misses, cs.ra_issued, cs.ra_hits, cs.evictions);
+    seq_printf(m, "blocks %u/%u\nblock_size %u\n", cs.nr_blocks, cs.max_blocks, cs.block_size);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kmod_cache);
+
+static int kmod_pool_stats_show(struct seq_file *m, void *v) {
+    kmod_pool_show(m);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kmod_pool_stats);
+
+static int kmod_blk_stats_show(struct seq_file *m, void *v) {
+    kmod_blk_show(m);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kmod_blk_stats);
+
+static int kmod_members_stats_show(struct seq_file *m, void *v) {
+    kmod_stripe_show(m);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kmod_members_stats);
+
+static int kmod_ram_stats_show(struct seq_file *m, void *v) {
+    kmod_ram_show(m);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kmod_ram_stats);
+
+static int kmod_integrity_stats_show(struct seq_file *m, void *v) {
+    kmod_integrity_show(m);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kmod_integrity_stats);
+
+static ssize_t kmod_reset_write(struct file *file, const char __user *buf,
+                                size_t count, loff_t *ppos) {
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(kmod_stats, cpu), 0, sizeof(struct kmod_cpu_stats));
+
+    return count;
+}
+
+static const struct file_operations kmod_reset_fops = {
+    .owner  = THIS_MODULE,
+    .open   = simple_open,
+    .write  = kmod_reset_write,
+    .llseek = noop_llseek,
+};
+
+bool kmod_stats_init(void) {
+    kmod_stats = alloc_percpu(struct kmod_cpu_stats);
+    if (!kmod_stats)
+        return false;
+
+    /* debugfs is best effort, the counters work without it */
+    kmod_debugfs = debugfs_create_dir("kmod", NULL);
+    debugfs_create_file("stats", 0444, kmod_debugfs, NULL, &kmod_stats_fops);
+    debugfs_create_file("latency", 0444, kmod_debugfs, NULL, &kmod_latency_fops);
+    debugfs_create_file("cache", 0444, kmod_debugfs, NULL, &kmod_cache_fops);
+    debugfs_create_file("pool", 0444, kmod_debugfs, NULL, &kmod_pool_stats_fops);
+    debugfs_create_file("blk", 0444, kmod_debugfs, NULL, &kmod_blk_stats_fops);
+    debugfs_create_file("members", 0444, kmod_debugfs, NULL, &kmod_members_stats_fops);
+    debugfs_create_file("ram", 0444, kmod_debugfs, NULL, &kmod_ram_stats_fops);
+    debugfs_create_file("integrity", 0444, kmod_debugfs, NULL, &kmod_integrity_stats_fops);
+    debugfs_create_file("reset", 0200, kmod_debugfs, NULL, &kmod_reset_fops);
+
+    return true;
+}
+
+void kmod_stats_teardown(void) {
+    debugfs_remove_recursive(kmod_debugfs);
+    kmod_debugfs = NULL;
+    free_percpu(kmod_stats);
+    kmod_stats = NULL;
+}
@@ -0,0 +1,336 @@
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/minmax.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/sched/mm.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+
+#include "kmod-common.h"
+
+/*
+ * RAID-0 striping over the devices given in devices=. The logical device is
+ * cut into stripe_kb stripes dealt round-robin to the members, so stripe s
+ * lives on member s % n at member offset (s / n) * stripe. Requests that
+ * stay inside one stripe go straight to their member. Larger ones are
+ * split: every member involved gets one work item covering all of its
+ * stripes of the request, and the members run in parallel. The logical
+ * size is n times the smallest member, rounded down to whole stripes.
+ */
+
+/* Stripe size in KiB, a power of two */
+static unsigned int stripe_kb = 64;
+module_param(stripe_kb, uint, S_IRUGO);
+
+struct kmod_member {
+    const char  *path;
+    struct file *file;
+    loff_t      size;
+
+    /* Balance counters shown in debugfs */
+    atomic64_t  reads;
+    atomic64_t  writes;
+    atomic64_t  read_bytes;
+    atomic64_t  write_bytes;
+    atomic64_t  busy_ns;
+};
+
+/* One member's share of a striped request */
+struct kmod_stripe_io {
+    struct work_struct  work;
+    struct completion   done;
+    unsigned int        member;
+    char                *buf;
+    size_t              size;
+    loff_t              pos;
+    bool                write;
+    ssize_t             result;
+};
+
+static struct kmod_member stripe_members[KMOD_MAX_MEMBERS];
+static unsigned int stripe_nr;
+static unsigned int stripe_shift;
+static loff_t stripe_dev_size;
+static struct workqueue_struct *stripe_wq;
+
+bool kmod_stripe_enabled(void) {
+    return stripe_nr > 1;
+}
+
+loff_t kmod_stripe_size(void) {
+    return stripe_dev_size;
+}
+
+struct file *kmod_stripe_file(unsigned int member) {
+    return stripe_members[member].file;
+}
+
+/* Member and member offset holding logical offset pos */
+static unsigned int kmod_stripe_map(loff_t pos, loff_t *mpos) {
+    u64 stripe = (u64)pos >> stripe_shift;
+    u64 row = div_u64(stripe, stripe_nr);
+    unsigned int member = stripe - row * stripe_nr;
+
+    *mpos = (row << stripe_shift) + (pos & ((1LL << stripe_shift) - 1));
+    return member;
+}
+
+static ssize_t kmod_member_rw(unsigned int member, char *buf, size_t size,
+                              loff_t mpos, bool write) {
+    struct kmod_member *m = &stripe_members[member];
+    u64 start = ktime_get_ns();
+    ssize_t bytes;
+
+    bytes = kmod_file_rw(m->file, buf, size, &mpos, write);
+
+    atomic64_add(ktime_get_ns() - start, &m->busy_ns);
+    atomic64_inc(write ? &m->writes : &m->reads);
+    if (bytes > 0)
+        atomic64_add(bytes, write ? &m->write_bytes : &m->read_bytes);
+    return bytes;
+}
+
+/* Run every stripe of the request that lives on io->member */
+static void kmod_stripe_work(struct work_struct *work) {
+    struct kmod_stripe_io *io = container_of(work, struct kmod_stripe_io, work);
+    size_t stripe = (size_t)1 << stripe_shift, off = 0;
+    unsigned int noio;
+    ssize_t bytes;
+
+    /*
+     * The submitter may be writing back pages of /dev/kmodblk0 under
+     * memory pressure, so allocations here must not recurse into I/O
+     */
+    noio = memalloc_noio_save();
+    io->result = 0;
+    while (off < io->size) {
+        loff_t pos = io->pos + off, mpos;
+        size_t len = min(io->size - off, stripe - (size_t)(pos & (stripe - 1)));
+
+        if (kmod_stripe_map(pos, &mpos) == io->member) {
+            bytes = kmod_member_rw(io->member, io->buf + off, len, mpos, io->write);
+            if (bytes != len) {
+                io->result = bytes < 0 ? bytes : -EIO;
+                break;
+            }
+            io->result += bytes;
+        }
+        off += len;
+    }
+    memalloc_noio_restore(noio);
+
+    complete(&io->done);
+}
+
+ssize_t kmod_stripe_rw(void *buf, size_t size, loff_t *pos, bool write) {
+    struct kmod_stripe_io io[KMOD_MAX_MEMBERS];
+    size_t stripe = (size_t)1 << stripe_shift;
+    unsigned int i, nr;
+    ssize_t ret = 0;
+    loff_t mpos;
+
+    /* Same end-of-device behaviour as a single block device */
+    if (*pos >= stripe_dev_size)
+        return write ? -ENOSPC : 0;
+    if (*pos + size > stripe_dev_size) {
+        if (write)
+            return -ENOSPC;
+        size = stripe_dev_size - *pos;
+    }
+    if (!size)
+        return 0;
+
+    /* Inside one stripe: no splitting needed */
+    if ((*pos & (stripe - 1)) + size <= stripe) {
+        i = kmod_stripe_map(*pos, &mpos);
+        ret = kmod_member_rw(i, buf, size, mpos, write);
+        if (ret > 0)
+            *pos += ret;
+        return ret;
+    }
+
+    /* Every member the request touches works on its share in parallel */
+    nr = min_t(u64, stripe_nr, DIV_ROUND_UP((*pos & (stripe - 1)) + size, stripe));
+    for (i = 0; i < nr; i++) {
+        INIT_WORK_ONSTACK(&io[i].work, kmod_stripe_work);
+        init_completion(&io[i].done);
+        io[i].member = kmod_stripe_map(*pos + (loff_t)i * stripe - (*pos & (stripe - 1)), &mpos);
+        io[i].buf = buf;
+        io[i].size = size;
+        io[i].pos = *pos;
+        io[i].write = write;
+        if (i)
+            queue_work(stripe_wq, &io[i].work);
+    }
+
+    /* The caller takes the first member itself */
+    kmod_stripe_work(&io[0].work);
+
+    for (i = 0; i < nr; i++) {
+        wait_for_completion(&io[i].done);
+        if (io[i].result < 0 && !ret)
+            ret = io[i].result;
+        destroy_work_on_stack(&io[i].work);
+    }
+
+    if (ret)
+        return ret;
+
+    *pos += size;
+    return size;
+}
+
+/*
+ * Discard or zero a logical range. Each member's stripes of the range sit
+ * in consecutive rows, so they form one contiguous range on the member
+ * that only the first and last stripe can cut short.
+ */
+int kmod_stripe_discard(loff_t pos, u64 len, bool zero) {
+    u64 first = (u64)pos >> stripe_shift, last = (u64)(pos + len - 1) >> stripe_shift;
+    unsigned int i, member;
+    loff_t start, end, mstart, mend;
+    u64 sf, sl;
+    u32 rem;
+    int ret;
+
+    for (i = 0; i < stripe_nr && first + i <= last; i++) {
+        /* First and last stripe of the range that live on this member */
+        sf = first + i;
+        div_u64_rem(last - sf, stripe_nr, &rem);
+        sl = last - rem;
+        start = max_t(loff_t, pos, sf << stripe_shift);
+        end = min_t(loff_t, pos + len, (sl + 1) << stripe_shift);
+
+        member = kmod_stripe_map(start, &mstart);
+        kmod_stripe_map(end - 1, &mend);
+        ret = kmod_file_discard(stripe_members[member].file, mstart, mend + 1 - mstart, zero);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+int kmod_stripe_sync(void) {
+    unsigned int i;
+    int err, ret = 0;
+
+    for (i = 0; i < stripe_nr; i++) {
+        err = vfs_fsync(stripe_members[i].file, 0);
+        if (err && !ret)
+            ret = err;
+    }
+    return ret;
+}
+
+unsigned int kmod_stripe_block_size(void) {
+    unsigned int i, lbs = SECTOR_SIZE;
+
+    for (i = 0; i < stripe_nr; i++)
+        lbs = max(lbs, kmod_file_block_size(stripe_members[i].file));
+    return lbs;
+}
+
+void kmod_stripe_show(struct seq_file *m) {
+    u64 total = 0, bytes[KMOD_MAX_MEMBERS];
+    unsigned int i;
+
+    if (!kmod_stripe_enabled()) {
+        seq_puts(m, "single device\n");
+        return;
+    }
+
+    for (i = 0; i < stripe_nr; i++) {
+        bytes[i] = atomic64_read(&stripe_members[i].read_bytes) +
+                   atomic64_read(&stripe_members[i].write_bytes);
+        total += bytes[i];
+    }
+
+    seq_printf(m, "stripe %zu bytes over %u members, %lld bytes\n",
+               (size_t)1 << stripe_shift, stripe_nr, stripe_dev_size);
+    seq_printf(m, "%-16s %12s %12s %16s %16s %12s %6s\n", "member", "reads", "writes",
+               "read_bytes", "write_bytes", "busy_ms", "share");
+    for (i = 0; i < stripe_nr; i++) {
+        struct kmod_member *mb = &stripe_members[i];
+
+        seq_printf(m, "%-16s %12lld %12lld %16lld %16lld %12lld %5llu%%\n", mb->path,
+                   atomic64_read(&mb->reads), atomic64_read(&mb->writes),
+                   atomic64_read(&mb->read_bytes), atomic64_read(&mb->write_bytes),
+                   div_s64(atomic64_read(&mb->busy_ns), NSEC_PER_MSEC),
+                   total ? div64_u64(bytes[i] * 100, total) : 0);
+    }
+}
+
+void kmod_stripe_close(void) {
+    unsigned int i;
+
+    if (stripe_wq) {
+        destroy_workqueue(stripe_wq);
+        stripe_wq = NULL;
+    }
+
+    for (i = 0; i < stripe_nr; i++) {
+        if (!IS_ERR_OR_NULL(stripe_members[i].file))
+            kmod_dev_close(stripe_members[i].file);
+        stripe_members[i].file = NULL;
+    }
+    stripe_nr = 0;
+}
+
+bool kmod_stripe_open(char **paths, unsigned int nr) {
+    loff_t min_size = LLONG_MAX;
+    unsigned int i;
+
+    if (nr < 2 || nr > KMOD_MAX_MEMBERS)
+        return false;
+
+    if (stripe_kb < 4 || !is_power_of_2(stripe_kb)) {
+        printk(KERN_ERR "stripe_kb must be a power of two of at least 4\n");
+        return false;
+    }
+    stripe_shift = ilog2(stripe_kb) + 10;
+
+    /* Reclaim can wait on requests that need this queue to make progress */
+    stripe_wq = alloc_workqueue("kmod-stripe", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+    if (!stripe_wq)
+        return false;
+
+    for (i = 0; i < nr; i++) {
+        struct kmod_member *m = &stripe_members[i];
+
+        m->path = paths[i];
+        m->file = kmod_dev_open(paths[i]);
+        stripe_nr = i + 1;
+        if (IS_ERR(m->file))
+            goto fail;
+
+        m->size = kmod_file_size(m->file);
+        min_size = min(min_size, m->size);
+        atomic64_set(&m->reads, 0);
+        atomic64_set(&m->writes, 0);
+        atomic64_set(&m->read_bytes, 0);
+        atomic64_set(&m->write_bytes, 0);
+        atomic64_set(&m->busy_ns, 0);
+        printk(KERN_INFO "Stripe member %u: %s, %lld bytes\n", i, paths[i], m->size);
+    }
+
+    /* Only whole rows of stripes on the smallest member are usable */
+    stripe_dev_size = ((min_size >> stripe_shift) << stripe_shift) * nr;
+    if (!stripe_dev_size) {
+        printk(KERN_ERR "Stripe members are smaller than one stripe\n");
+        goto fail;
+    }
+
+    printk(KERN_INFO "Striping %u devices in %u KiB stripes, %lld bytes\n",
+           nr, stripe_kb, stripe_dev_size);
+    return true;
+
+fail:
+    kmod_stripe_close();
+    return false;
+}
@@ -0,0 +1,81 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM kmod
+
+#if !defined(_KMOD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KMOD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "kmod-common.h"
+
+TRACE_DEFINE_ENUM(KMOD_STAT_READ);
+TRACE_DEFINE_ENUM(KMOD_STAT_WRITE);
+TRACE_DEFINE_ENUM(KMOD_STAT_READOFFSET);
+TRACE_DEFINE_ENUM(KMOD_STAT_WRITEOFFSET);
+TRACE_DEFINE_ENUM(KMOD_STAT_DISCARD);
+TRACE_DEFINE_ENUM(KMOD_STAT_WRITEZEROES);
+TRACE_DEFINE_ENUM(KMOD_STAT_COPY);
+
+#define kmod_show_op(op)                        \
+    __print_symbolic(op,                        \
+        { KMOD_STAT_READ,        "READ" },      \
+        { KMOD_STAT_WRITE,       "WRITE" },     \
+        { KMOD_STAT_READOFFSET,  "READOFFSET" },\
+        { KMOD_STAT_WRITEOFFSET, "WRITEOFFSET" },\
+        { KMOD_STAT_DISCARD,     "DISCARD" },   \
+        { KMOD_STAT_WRITEZEROES, "WRITEZEROES" },\
+        { KMOD_STAT_COPY,        "COPY" })
+
+TRACE_EVENT(kmod_submit,
+
+    TP_PROTO(int op, loff_t pos, u64 size),
+
+    TP_ARGS(op, pos, size),
+
+    TP_STRUCT__entry(
+        __field(int,        op)
+        __field(loff_t,     pos)
+        __field(u64,        size)
+    ),
+
+    TP_fast_assign(
+        __entry->op = op;
+        __entry->pos = pos;
+        __entry->size = size;
+    ),
+
+    TP_printk("op=%s pos=%lld size=%llu",
+              kmod_show_op(__entry->op), __entry->pos, __entry->size)
+);
+
+TRACE_EVENT(kmod_complete,
+
+    TP_PROTO(int op, u64 size, long ret, u64 lat_ns),
+
+    TP_ARGS(op, size, ret, lat_ns),
+
+    TP_STRUCT__entry(
+        __field(int,        op)
+        __field(u64,        size)
+        __field(long,       ret)
+        __field(u64,        lat_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->op = op;
+        __entry->size = size;
+        __entry->ret = ret;
+        __entry->lat_ns = lat_ns;
+    ),
+
+    TP_printk("op=%s size=%llu ret=%ld lat_ns=%llu",
+              kmod_show_op(__entry->op), __entry->size, __entry->ret, __entry->lat_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE kmod-trace
+#include <trace/define_trace.h>
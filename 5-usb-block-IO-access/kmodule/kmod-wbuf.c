@@ -0,0 +1,219 @@
+#include <linux/errseq.h>
+#include <linux/minmax.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "kmod-common.h"
+
+/*
+ * Write-coalescing buffer. Small writes that append to (or overwrite part
+ * of) the pending run are absorbed into a wbuf_kb buffer and written out as
+ * one large request when the buffer fills, after wbuf_flush_ms, on release,
+ * or on BFLUSH. Anything that doesn't fit the run flushes it first, so the
+ * device always sees writes in order. Reads overlapping the pending run get
+ * the buffered bytes laid over what came back from the device.
+ *
+ * When the buffer fills, only the part up to the last logical block boundary
+ * is written and the tail stays buffered, so a run that starts aligned keeps
+ * going out as whole blocks.
+ *
+ * Errors from background flushes can't be returned to the writer. They are
+ * recorded in an errseq_t instead, and every open file samples it, so each
+ * one sees a failure once on its next BFLUSH or close, no matter which file
+ * looked first.
+ */
+
+/* Coalescing buffer size in KiB, 0 disables write coalescing */
+static unsigned int wbuf_kb = 0;
+module_param(wbuf_kb, uint, S_IRUGO);
+
+/* Maximum time a write may sit in the buffer */
+static unsigned int wbuf_flush_ms = 50;
+module_param(wbuf_flush_ms, uint, S_IRUGO | S_IWUSR);
+
+static DEFINE_MUTEX(wbuf_lock);
+static char *wbuf_data;
+static size_t wbuf_cap;
+static size_t wbuf_len;
+static loff_t wbuf_start;
+static errseq_t wbuf_err;
+static struct delayed_work wbuf_work;
+
+/* Called with wbuf_lock held */
+static bool kmod_wbuf_overlaps(loff_t pos, size_t size) {
+    return wbuf_len && pos < wbuf_start + wbuf_len && pos + size > wbuf_start;
+}
+
+/* Write out the first len bytes of the run, called with wbuf_lock held */
+static int __kmod_wbuf_write_out(size_t len) {
+    loff_t pos = wbuf_start;
+    ssize_t bytes;
+    int err = 0;
+
+    bytes = kmod_dev_raw_write(wbuf_data, len, &pos);
+    if (bytes != len) {
+        err = bytes < 0 ? bytes : -EIO;
+        printk(KERN_ERR "Write buffer flush at %lld failed, error: %d\n", wbuf_start, err);
+        errseq_set(&wbuf_err, err);
+    }
+
+    /* Keep what is left over as the start of the next run */
+    wbuf_len -= len;
+    wbuf_start += len;
+    if (wbuf_len)
+        memmove(wbuf_data, wbuf_data + len, wbuf_len);
+    return err;
+}
+
+/* Write out the pending run, called with wbuf_lock held */
+static int __kmod_wbuf_flush(void) {
+    if (!wbuf_len)
+        return 0;
+    return __kmod_wbuf_write_out(wbuf_len);
+}
+
+/* Write out a full run up to its last block boundary, called with wbuf_lock held */
+static void __kmod_wbuf_flush_full(void) {
+    loff_t end = round_down(wbuf_start + wbuf_len, kmod_dev_block_size());
+
+    if (end <= wbuf_start) {
+        __kmod_wbuf_flush();
+        return;
+    }
+
+    __kmod_wbuf_write_out(end - wbuf_start);
+    if (wbuf_len)
+        mod_delayed_work(system_wq, &wbuf_work, msecs_to_jiffies(wbuf_flush_ms));
+}
+
+static void kmod_wbuf_timeout(struct work_struct *work) {
+    mutex_lock(&wbuf_lock);
+    __kmod_wbuf_flush();
+    mutex_unlock(&wbuf_lock);
+}
+
+bool kmod_wbuf_enabled(void) {
+    return wbuf_data != NULL;
+}
+
+ssize_t kmod_wbuf_write(const void *buf, size_t size, loff_t *pos) {
+    ssize_t bytes;
+
+    mutex_lock(&wbuf_lock);
+
+    /* Appends and overwrites that stay inside the buffer window are absorbed */
+    if (wbuf_len && *pos >= wbuf_start && *pos <= wbuf_start + wbuf_len &&
+        *pos + size <= wbuf_start + wbuf_cap) {
+        memcpy(wbuf_data + (*pos - wbuf_start), buf, size);
+        wbuf_len = max_t(size_t, wbuf_len, *pos + size - wbuf_start);
+        goto absorbed;
+    }
+
+    /* Anything else ends the current run first */
+    __kmod_wbuf_flush();
+
+    /* Big writes gain nothing from the buffer */
+    if (size >= wbuf_cap) {
+        bytes = kmod_dev_raw_write(buf, size, pos);
+        mutex_unlock(&wbuf_lock);
+        return bytes;
+    }
+
+    wbuf_start = *pos;
+    wbuf_len = size;
+    memcpy(wbuf_data, buf, size);
+    mod_delayed_work(system_wq, &wbuf_work, msecs_to_jiffies(wbuf_flush_ms));
+
+absorbed:
+    if (wbuf_len == wbuf_cap)
+        __kmod_wbuf_flush_full();
+    mutex_unlock(&wbuf_lock);
+
+    *pos += size;
+    return size;
+}
+
+ssize_t kmod_wbuf_read(void *buf, size_t size, loff_t *pos) {
+    loff_t start = *pos, lo, hi;
+    ssize_t bytes;
+
+    mutex_lock(&wbuf_lock);
+    if (!kmod_wbuf_overlaps(start, size)) {
+        mutex_unlock(&wbuf_lock);
+        return kmod_dev_raw_read(buf, size, pos);
+    }
+
+    /* Keep the run from being flushed between the read and the overlay */
+    bytes = kmod_dev_raw_read(buf, size, pos);
+    if (bytes > 0) {
+        lo = max(start, wbuf_start);
+        hi = min_t(loff_t, start + bytes, wbuf_start + wbuf_len);
+        if (lo < hi)
+            memcpy(buf + (lo - start), wbuf_data + (lo - wbuf_start), hi - lo);
+    }
+    mutex_unlock(&wbuf_lock);
+
+    return bytes;
+}
+
+/* Write out the pending run if it overlaps I/O that bypasses the buffer */
+void kmod_wbuf_sync_range(loff_t pos, size_t size) {
+    if (!kmod_wbuf_enabled())
+        return;
+
+    mutex_lock(&wbuf_lock);
+    if (kmod_wbuf_overlaps(pos, size))
+        __kmod_wbuf_flush();
+    mutex_unlock(&wbuf_lock);
+}
+
+/* Cursor for kmod_wbuf_flush(), taken when a file is opened */
+errseq_t kmod_wbuf_sample(void) {
+    return errseq_sample(&wbuf_err);
+}
+
+/*
+ * Flush the pending run. With a cursor, report any flush error since the
+ * cursor was last advanced, otherwise only the error of this flush.
+ */
+int kmod_wbuf_flush(errseq_t *since) {
+    int err;
+
+    if (!kmod_wbuf_enabled())
+        return 0;
+
+    mutex_lock(&wbuf_lock);
+    err = __kmod_wbuf_flush();
+    if (since)
+        err = errseq_check_and_advance(&wbuf_err, since);
+    mutex_unlock(&wbuf_lock);
+
+    return err;
+}
+
+bool kmod_wbuf_init(void) {
+    if (!wbuf_kb)
+        return true;
+
+    wbuf_cap = (size_t)wbuf_kb << 10;
+    wbuf_data = kvmalloc(wbuf_cap, GFP_KERNEL);
+    if (!wbuf_data)
+        return false;
+
+    INIT_DELAYED_WORK(&wbuf_work, kmod_wbuf_timeout);
+    printk(KERN_INFO "Write buffer: %zu bytes, flush after %u ms\n", wbuf_cap, wbuf_flush_ms);
+    return true;
+}
+
+void kmod_wbuf_teardown(void) {
+    if (!kmod_wbuf_enabled())
+        return;
+
+    cancel_delayed_work_sync(&wbuf_work);
+    kmod_wbuf_flush(NULL);
+    kvfree(wbuf_data);
+    wbuf_data = NULL;
+}
@@ -0,0 +1,218 @@
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/err.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/minmax.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/overflow.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#include "kmod-common.h"
+
+/*
+ * Per-CPU worker threads for the copy path. With workers set, one kthread
+ * is bound to each of the first workers online CPUs, each with its own
+ * request queue. Copy-path requests larger than worker_split_kb are cut
+ * into pieces that are spread over the queues and run concurrently, and
+ * the non-zero-copy segments of BREADV/BWRITEV are handed out one per
+ * queue, so a single caller keeps several requests in flight on the device.
+ * Workers borrow the submitter's mm for the user copies while the
+ * submitter sleeps on the request's completion.
+ */
+
+/* Number of worker threads, 0 runs everything in the caller */
+static unsigned int workers = 0;
+module_param(workers, uint, S_IRUGO);
+
+/* Copy-path requests above this size in KiB are split across the workers */
+static unsigned int worker_split_kb = 1024;
+module_param(worker_split_kb, uint, S_IRUGO);
+
+struct kmod_worker {
+    struct task_struct  *task;
+    spinlock_t          lock;
+    struct list_head    queue;
+    wait_queue_head_t   wait;
+};
+
+static struct kmod_worker *worker_pool;
+static unsigned int nr_workers;
+static atomic_t worker_next = ATOMIC_INIT(0);
+
+static void kmod_worker_run(struct kmod_work_req *req) {
+    loff_t pos = req->pos;
+
+    kthread_use_mm(req->mm);
+    if (req->write)
+        req->result = kmod_chunk_write(req->data, req->size, &pos);
+    else
+        req->result = kmod_chunk_read(req->data, req->size, &pos, false);
+    kthread_unuse_mm(req->mm);
+
+    complete(&req->done);
+}
+
+static struct kmod_work_req *kmod_worker_dequeue(struct kmod_worker *w) {
+    struct kmod_work_req *req;
+
+    spin_lock(&w->lock);
+    req = list_first_entry_or_null(&w->queue, struct kmod_work_req, node);
+    if (req)
+        list_del(&req->node);
+    spin_unlock(&w->lock);
+
+    return req;
+}
+
+static int kmod_worker_fn(void *data) {
+    struct kmod_worker *w = data;
+    struct kmod_work_req *req;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(w->wait,
+                                 !list_empty_careful(&w->queue) || kthread_should_stop());
+
+        while ((req = kmod_worker_dequeue(w)))
+            kmod_worker_run(req);
+    }
+
+    return 0;
+}
+
+bool kmod_workers_enabled(void) {
+    return nr_workers != 0;
+}
+
+bool kmod_workers_should_split(size_t size) {
+    return nr_workers > 1 && worker_split_kb && size > ((size_t)worker_split_kb << 10);
+}
+
+/* Queue a copy-path request on worker slot % nr_workers */
+void kmod_workers_submit(struct kmod_work_req *req, char __user *data, size_t size,
+                         loff_t pos, bool write, unsigned int slot) {
+    struct kmod_worker *w = &worker_pool[slot % nr_workers];
+
+    req->mm = current->mm;
+    req->data = data;
+    req->size = size;
+    req->pos = pos;
+    req->write = write;
+    init_completion(&req->done);
+
+    spin_lock(&w->lock);
+    list_add_tail(&req->node, &w->queue);
+    spin_unlock(&w->lock);
+    wake_up(&w->wait);
+}
+
+ssize_t kmod_workers_wait(struct kmod_work_req *req) {
+    wait_for_completion(&req->done);
+    return req->result;
+}
+
+/* Next slot to start handing requests out from, so callers spread over the queues */
+unsigned int kmod_workers_next_slot(unsigned int nr) {
+    return atomic_add_return(nr, &worker_next) - nr;
+}
+
+/*
+ * Split one copy-path request into worker_split_kb pieces and run them in
+ * parallel. Like a single request, the result is the length of the leading
+ * run of bytes that made it, or the error of the first piece.
+ */
+ssize_t kmod_workers_rw(char __user *data, size_t size, loff_t *pos, bool write) {
+    size_t piece = (size_t)worker_split_kb << 10;
+    unsigned int nr = DIV_ROUND_UP(size, piece), i, slot;
+    struct kmod_work_req *reqs;
+    ssize_t ret = 0, bytes;
+    size_t done = 0;
+    bool short_io = false;
+
+    reqs = kmod_pool_alloc(array_size(nr, sizeof(*reqs)));
+    if (!reqs)
+        return -ENOMEM;
+
+    slot = kmod_workers_next_slot(nr);
+    for (i = 0; i < nr; i++) {
+        size_t off = (size_t)i * piece;
+
+        kmod_workers_submit(&reqs[i], data + off, min(size - off, piece),
+                            *pos + off, write, slot + i);
+    }
+
+    /* Every piece has to finish before its buffer can go back */
+    for (i = 0; i < nr; i++) {
+        bytes = kmod_workers_wait(&reqs[i]);
+        if (short_io)
+            continue;
+
+        if (bytes < 0) {
+            if (!done)
+                ret = bytes;
+            short_io = true;
+            continue;
+        }
+
+        done += bytes;
+        if (bytes != reqs[i].size)
+            short_io = true;
+    }
+
+    kmod_pool_free(reqs, array_size(nr, sizeof(*reqs)));
+
+    if (!done)
+        return ret;
+
+    *pos += done;
+    return done;
+}
+
+void kmod_workers_teardown(void) {
+    unsigned int i;
+
+    for (i = 0; i < nr_workers; i++)
+        kthread_stop(worker_pool[i].task);
+    kfree(worker_pool);
+    worker_pool = NULL;
+    nr_workers = 0;
+}
+
+bool kmod_workers_init(void) {
+    unsigned int cpu, n = min(workers, num_online_cpus());
+
+    if (!n)
+        return true;
+
+    worker_pool = kcalloc(n, sizeof(*worker_pool), GFP_KERNEL);
+    if (!worker_pool)
+        return false;
+
+    for_each_online_cpu(cpu) {
+        struct kmod_worker *w;
+
+        if (nr_workers == n)
+            break;
+
+        w = &worker_pool[nr_workers];
+        spin_lock_init(&w->lock);
+        INIT_LIST_HEAD(&w->queue);
+        init_waitqueue_head(&w->wait);
+
+        w->task = kthread_create_on_cpu(kmod_worker_fn, w, cpu, "kmod-worker/%u");
+        if (IS_ERR(w->task)) {
+            kmod_workers_teardown();
+            return false;
+        }
+        wake_up_process(w->task);
+        nr_workers++;
+    }
+
+    printk(KERN_INFO "Worker pool: %u threads, requests over %u KiB are split\n",
+           nr_workers, worker_split_kb);
+    return true;
+}
@@ -0,0 +1,163 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/overflow.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+
+#include "kmod-common.h"
+
+/*
+ * Zero-copy path: instead of bouncing through a vmalloc buffer, pin the
+ * caller's pages and build bios straight over them. Only requests that
+ * satisfy the device's block size and DMA alignment can go this way, the
+ * ioctl layer falls back to the copy path for everything else.
+ */
+
+static void kmod_zcopy_end_io(struct bio *bio) {
+    struct kmod_zcopy_req *req = bio->bi_private;
+
+    if (bio->bi_status)
+        WRITE_ONCE(req->status, bio->bi_status);
+
+    bio_put(bio);
+    if (atomic_dec_and_test(&req->pending))
+        complete(&req->done);
+}
+
+bool kmod_zcopy_capable(const void __user *buf, size_t size, loff_t pos) {
+    struct block_device *bdev;
+    unsigned long mask;
+
+    if (!usb_file || !size || !S_ISBLK(file_inode(usb_file)->i_mode))
+        return false;
+
+    /* Pinned pages go to one device, striped requests take the copy path */
+    if (kmod_stripe_enabled())
+        return false;
+
+    /* Checksums are computed on the copy path only */
+    if (kmod_integrity_enabled())
+        return false;
+
+    bdev = file_bdev(usb_file);
+    mask = (bdev_logical_block_size(bdev) - 1) | bdev_dma_alignment(bdev);
+
+    /* Offset, length and buffer must all respect the device alignment */
+    return !(((unsigned long)buf | size | pos) & mask);
+}
+
+/* Pin the buffer and submit its bios, completion is collected by kmod_zcopy_wait() */
+int kmod_zcopy_submit(struct kmod_zcopy_req *req, void __user *buf, size_t size, loff_t pos, bool write) {
+    struct block_device *bdev = file_bdev(usb_file);
+    unsigned long uaddr = (unsigned long)buf;
+    unsigned int gup_flags = write ? 0 : FOLL_WRITE;
+    blk_opf_t opf = write ? REQ_OP_WRITE | REQ_SYNC : REQ_OP_READ;
+    struct bio *bio = NULL;
+    size_t remaining = size;
+    unsigned int offset;
+    sector_t sector;
+    int pinned, i, ret;
+
+    req->size = size;
+    req->pos = pos;
+    req->write = write;
+    req->nr_pages = DIV_ROUND_UP(offset_in_page(uaddr) + size, PAGE_SIZE);
+    req->pages = kmod_pool_alloc(array_size(req->nr_pages, sizeof(*req->pages)));
+    if (!req->pages)
+        return -ENOMEM;
+
+    pinned = pin_user_pages_fast(uaddr & PAGE_MASK, req->nr_pages, gup_flags, req->pages);
+    if (pinned != req->nr_pages) {
+        printk(KERN_ERR "Failed to pin user buffer (%d/%d pages)\n", pinned, req->nr_pages);
+        ret = pinned < 0 ? pinned : -EFAULT;
+        if (pinned > 0)
+            unpin_user_pages(req->pages, pinned);
+        goto out_free;
+    }
+
+    /* The bios bypass the page cache and write buffer, so push those out first */
+    kmod_wbuf_sync_range(pos, size);
+    ret = filemap_write_and_wait_range(usb_file->f_mapping, pos, pos + size - 1);
+    if (ret)
+        goto out_unpin;
+
+    atomic_set(&req->pending, 1);
+    req->status = BLK_STS_OK;
+    init_completion(&req->done);
+
+    sector = pos >> SECTOR_SHIFT;
+    offset = offset_in_page(uaddr);
+    for (i = 0; i < req->nr_pages; i++) {
+        unsigned int len = min_t(size_t, PAGE_SIZE - offset, remaining);
+
+        if (!bio || bio_add_page(bio, req->pages[i], len, offset) != len) {
+            if (bio) {
+                atomic_inc(&req->pending);
+                submit_bio(bio);
+            }
+
+            bio = bio_alloc(bdev, min_t(unsigned int, req->nr_pages - i, BIO_MAX_VECS),
+                            opf, GFP_KERNEL);
+            bio->bi_iter.bi_sector = sector;
+            bio->bi_private = req;
+            bio->bi_end_io = kmod_zcopy_end_io;
+            __bio_add_page(bio, req->pages[i], len, offset);
+        }
+
+        sector += len >> SECTOR_SHIFT;
+        remaining -= len;
+        offset = 0;
+    }
+
+    atomic_inc(&req->pending);
+    submit_bio(bio);
+    return 0;
+
+out_unpin:
+    unpin_user_pages(req->pages, req->nr_pages);
+out_free:
+    kmod_pool_free(req->pages, array_size(req->nr_pages, sizeof(*req->pages)));
+    req->pages = NULL;
+    return ret;
+}
+
+ssize_t kmod_zcopy_wait(struct kmod_zcopy_req *req) {
+    loff_t end = req->pos + req->size - 1;
+    ssize_t ret;
+
+    /* Drop the submission bias and wait for the rest */
+    if (!atomic_dec_and_test(&req->pending))
+        wait_for_completion_io(&req->done);
+
+    ret = blk_status_to_errno(READ_ONCE(req->status));
+    if (!ret)
+        ret = req->size;
+
+    if (req->write) {
+        /* Stale cached copies of what we just wrote must not be served later */
+        invalidate_inode_pages2_range(usb_file->f_mapping, req->pos >> PAGE_SHIFT,
+                                      end >> PAGE_SHIFT);
+        kmod_cache_invalidate(req->pos, req->size);
+        unpin_user_pages(req->pages, req->nr_pages);
+    } else {
+        unpin_user_pages_dirty_lock(req->pages, req->nr_pages, ret > 0);
+    }
+
+    kmod_pool_free(req->pages, array_size(req->nr_pages, sizeof(*req->pages)));
+    req->pages = NULL;
+    return ret;
+}
+
+ssize_t kmod_zcopy_rw(void __user *buf, size_t size, loff_t pos, bool write) {
+    struct kmod_zcopy_req req;
+    int ret;
+
+    ret = kmod_zcopy_submit(&req, buf, size, pos, write);
+    if (ret)
+        return ret;
+
+    return kmod_zcopy_wait(&req);
+}